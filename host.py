@@ -1,4 +1,5 @@
 import asyncio
+import binascii
 import csv
 import json
 import pprint
@@ -12,6 +13,31 @@ PLATYNODE_2 = "12939F17-4861-09C9-1D2D-06714A323FAA"
 SEND_COMMAND_CHAR = "58e9dcbc-7de3-9bbd-d744-8a3b40a226fa"
 READ_RX_STATS_CHAR = "7371f8f8-cd17-d3ac-6048-6c5987b117c4"
 READ_TX_STATS_CHAR = "0a021046-2273-93b9-ec42-07b1acea14df"
+READ_SESSIONS_CHAR = "d39a216e-44c9-05b7-124f-6a901e528b3d"
+READ_CHANNELS_CHAR = "e648b572-d03a-1f96-8e4d-2ba409c7315e"
+READ_LATENCY_CHAR = "c821f34d-9e05-6cb2-5947-a03ed46f128b"
+
+SET_SEQUENCE_COMMAND = 0x04
+SET_BER_COMMAND = 0x05
+SET_PATTERN_COMMAND = 0x06
+SET_DUTY_CYCLE_COMMAND = 0x07
+SET_PACKETS_NUM_COMMAND = 0x08
+SET_RETRIES_COMMAND = 0x09
+START_TX_THROUGHPUT_COMMAND = 0x14
+START_PING_COMMAND = 0x15
+START_PONG_COMMAND = 0x16
+START_ACK_TX_COMMAND = 0x17
+START_ACK_RX_COMMAND = 0x18
+
+# enum transmit_pattern in src/radio.h
+PATTERN_PRBS9 = 0
+PATTERN_11110000 = 1
+PATTERN_11001100 = 2
+PATTERN_PRBS15 = 3
+START_TX_SWEEP_COMMAND = 0x12
+START_RX_SWEEP_COMMAND = 0x13
+SELECT_SESSION_COMMAND = 0x20
+SELECT_CHANNELS_COMMAND = 0x21
 
 prescaler = 1
 oscillator_frequency = 16_000_000 / (2**prescaler)
@@ -27,7 +53,20 @@ async def scan():
         print(a)
 
 
-async def run_test(device1, device2, tx_mode, tx_power, tx_channel, packet_size):
+async def run_test(
+    device1,
+    device2,
+    tx_mode,
+    tx_power,
+    tx_channel,
+    packet_size,
+    sequence=True,
+    ber=True,
+    pattern=PATTERN_PRBS9,
+    duty_cycle=100,
+    packets_num=5000,
+    throughput=False,
+):
     print(
         f"---------- STARTING TEST {tx_mode=} {tx_power=} {tx_channel=} -------------"
     )
@@ -53,6 +92,24 @@ async def run_test(device1, device2, tx_mode, tx_power, tx_channel, packet_size)
         await tx_client.write_gatt_char(
             SEND_COMMAND_CHAR, bytearray([0x03, packet_size]), response=False
         )
+        await tx_client.write_gatt_char(
+            SEND_COMMAND_CHAR,
+            bytearray([SET_SEQUENCE_COMMAND, int(sequence)]),
+            response=False,
+        )
+        await tx_client.write_gatt_char(
+            SEND_COMMAND_CHAR, bytearray([SET_PATTERN_COMMAND, pattern]), response=False
+        )
+        await tx_client.write_gatt_char(
+            SEND_COMMAND_CHAR,
+            bytearray([SET_DUTY_CYCLE_COMMAND, duty_cycle]),
+            response=False,
+        )
+        await tx_client.write_gatt_char(
+            SEND_COMMAND_CHAR,
+            bytearray([SET_PACKETS_NUM_COMMAND]) + packets_num.to_bytes(4, "little"),
+            response=False,
+        )
 
         await rx_client.write_gatt_char(
             SEND_COMMAND_CHAR, bytearray([0x00, tx_mode]), response=False
@@ -66,6 +123,17 @@ async def run_test(device1, device2, tx_mode, tx_power, tx_channel, packet_size)
         await rx_client.write_gatt_char(
             SEND_COMMAND_CHAR, bytearray([0x03, packet_size]), response=False
         )
+        await rx_client.write_gatt_char(
+            SEND_COMMAND_CHAR,
+            bytearray([SET_SEQUENCE_COMMAND, int(sequence)]),
+            response=False,
+        )
+        await rx_client.write_gatt_char(
+            SEND_COMMAND_CHAR, bytearray([SET_BER_COMMAND, int(ber)]), response=False
+        )
+        await rx_client.write_gatt_char(
+            SEND_COMMAND_CHAR, bytearray([SET_PATTERN_COMMAND, pattern]), response=False
+        )
 
         await asyncio.sleep(0.1)
 
@@ -76,7 +144,11 @@ async def run_test(device1, device2, tx_mode, tx_power, tx_channel, packet_size)
 
         # Start TX on client 1
         print("Starting TX")
-        await tx_client.write_gatt_char(SEND_COMMAND_CHAR, b"\x10", response=False)
+        await tx_client.write_gatt_char(
+            SEND_COMMAND_CHAR,
+            bytearray([START_TX_THROUGHPUT_COMMAND if throughput else 0x10]),
+            response=False,
+        )
 
         await asyncio.sleep(5)
         os.system("afplay /System/Library/Sounds/Submarine.aiff")
@@ -87,6 +159,89 @@ async def run_test(device1, device2, tx_mode, tx_power, tx_channel, packet_size)
         await rx_client.disconnect()
 
 
+# RSSI statistics, see radio_rssi_stats_write() in src/radio.c
+RSSI_BINS = 16
+RSSI_BIN_WIDTH = 8
+RSSI_STATS_SIZE = 18 + 4 * RSSI_BINS
+
+
+def decode_rssi_stats(buffer, count):
+    rssi_sum = int.from_bytes(buffer[2:10], "little")
+    rssi_sum_sq = int.from_bytes(buffer[10:18], "little")
+    stats = {
+        "min": -buffer[0] if count > 0 else None,
+        "max": -buffer[1] if count > 0 else None,
+        "mean": -rssi_sum / count if count > 0 else None,
+        # Sample variance, exact up to the final division
+        "variance": (count * rssi_sum_sq - rssi_sum**2) / (count * (count - 1))
+        if count > 1
+        else None,
+        "histogram": [
+            int.from_bytes(buffer[18 + 4 * i : 22 + 4 * i], "little")
+            for i in range(RSSI_BINS)
+        ],
+    }
+    return stats
+
+
+# Sequence statistics, see radio_seq_stats_write() in src/radio.c
+SEQ_BURST_BINS = 8
+SEQ_STATS_SIZE = 16 + 4 * SEQ_BURST_BINS
+
+
+def decode_seq_stats(buffer):
+    fields = [
+        int.from_bytes(buffer[4 * i : 4 * i + 4], "little")
+        for i in range(SEQ_STATS_SIZE // 4)
+    ]
+    return {
+        "received": fields[0],
+        "lost": fields[1],
+        "duplicates": fields[2],
+        "reordered": fields[3],
+        # Bin i counts bursts of 2**i to 2**(i + 1) - 1 lost packets
+        "bursts": fields[4:],
+    }
+
+
+# Bit error statistics, see radio_ber_stats_write() in src/radio.c
+BER_BINS = 12
+BER_STATS_SIZE = 28 + 4 * BER_BINS
+
+
+def decode_ber_stats(buffer):
+    bits = int.from_bytes(buffer[12:20], "little")
+    bit_errors = int.from_bytes(buffer[20:28], "little")
+    return {
+        "packets": int.from_bytes(buffer[0:4], "little"),
+        "errored_packets": int.from_bytes(buffer[4:8], "little"),
+        # PRBS packets too damaged to sync to, not in the counts
+        "unsynced": int.from_bytes(buffer[8:12], "little"),
+        "bits": bits,
+        "bit_errors": bit_errors,
+        "ber": bit_errors / bits if bits > 0 else None,
+        # Bin 0 counts error free packets, bin i packets with 2**(i - 1) to
+        # 2**i - 1 bit errors
+        "histogram": [
+            int.from_bytes(buffer[28 + 4 * i : 32 + 4 * i], "little")
+            for i in range(BER_BINS)
+        ],
+    }
+
+
+# Airtime and throughput, see radio_airtime_stats_write() in src/radio.c
+AIRTIME_STATS_SIZE = 16
+
+
+def decode_airtime_stats(buffer):
+    return {
+        "airtime_us": int.from_bytes(buffer[0:4], "little") / 1000,
+        "total_airtime_s": int.from_bytes(buffer[4:8], "little") / 1e6,
+        "pps": int.from_bytes(buffer[8:12], "little") / 1000,
+        "goodput_bps": int.from_bytes(buffer[12:16], "little"),
+    }
+
+
 async def read_stats(
     device1, device2, tx_mode, tx_power, tx_channel, packet_size, filename="results.csv"
 ):
@@ -111,14 +266,56 @@ async def read_stats(
             rx_stats[12] | rx_stats[13] << 8 | rx_stats[14] << 16 | rx_stats[15] << 24
         )
         sent = tx_stats[0] | tx_stats[1] << 8 | tx_stats[2] << 16 | tx_stats[3] << 24
+        # Set by duty-cycled and back to back TX, see radio_tx_stats_write()
+        # in src/radio.c
+        airtime_us = int.from_bytes(tx_stats[4:8], "little") / 1000
+        duty_cycle = int.from_bytes(tx_stats[8:12], "little") / 1e6
+        period_ns = int.from_bytes(tx_stats[12:16], "little")
+        max_fps = int.from_bytes(tx_stats[16:20], "little") / 1000
+        fps = 1e9 / period_ns if period_ns else None
+        tx_airtime = decode_airtime_stats(tx_stats[20 : 20 + AIRTIME_STATS_SIZE])
+        dropped = (
+            rx_stats[16] | rx_stats[17] << 8 | rx_stats[18] << 16 | rx_stats[19] << 24
+        )
+        events = (
+            rx_stats[20] | rx_stats[21] << 8 | rx_stats[22] << 16 | rx_stats[23] << 24
+        )
+        events_dropped = (
+            rx_stats[24] | rx_stats[25] << 8 | rx_stats[26] << 16 | rx_stats[27] << 24
+        )
+        rssi_stats = decode_rssi_stats(rx_stats[28 : 28 + RSSI_STATS_SIZE], packets)
+        seq_offset = 28 + RSSI_STATS_SIZE
+        seq_stats = decode_seq_stats(rx_stats[seq_offset : seq_offset + SEQ_STATS_SIZE])
+        ber_offset = seq_offset + SEQ_STATS_SIZE
+        ber_stats = decode_ber_stats(rx_stats[ber_offset : ber_offset + BER_STATS_SIZE])
+        airtime_offset = ber_offset + BER_STATS_SIZE
+        rx_airtime = decode_airtime_stats(
+            rx_stats[airtime_offset : airtime_offset + AIRTIME_STATS_SIZE]
+        )
 
         print(
-            f"{sent=} | {packets=} {crc=} {rssi=} {ticks=} time_taken={ticks/oscillator_frequency}s",
+            f"{sent=} {airtime_us=} {duty_cycle=} {fps=} {max_fps=} | {packets=} {crc=} {rssi=} {ticks=} time_taken={ticks/oscillator_frequency}s {dropped=} {events=} {events_dropped=}",
             end="",
         )
 
         if packets > 0:
             print(f" average_rssi={rssi/packets}", end="")
+        print(
+            f" rssi_min={rssi_stats['min']} rssi_max={rssi_stats['max']} rssi_variance={rssi_stats['variance']}",
+            end="",
+        )
+        print(
+            f" lost={seq_stats['lost']} duplicates={seq_stats['duplicates']} reordered={seq_stats['reordered']} bursts={seq_stats['bursts']}",
+            end="",
+        )
+        print(
+            f" ber={ber_stats['ber']} bit_errors={ber_stats['bit_errors']} unsynced={ber_stats['unsynced']} ber_histogram={ber_stats['histogram']}",
+            end="",
+        )
+        print(
+            f" packet_airtime_us={rx_airtime['airtime_us']} tx_pps={tx_airtime['pps']} tx_goodput_bps={tx_airtime['goodput_bps']} rx_pps={rx_airtime['pps']} rx_goodput_bps={rx_airtime['goodput_bps']}",
+            end="",
+        )
 
         with open(filename, "a+") as f:
             writer = csv.writer(f)
@@ -134,14 +331,298 @@ async def read_stats(
                     rssi,
                     ticks,
                     ticks / oscillator_frequency,
+                    rssi_stats["min"],
+                    rssi_stats["max"],
+                    rssi_stats["variance"],
+                    " ".join(str(n) for n in rssi_stats["histogram"]),
+                    seq_stats["lost"],
+                    seq_stats["duplicates"],
+                    seq_stats["reordered"],
+                    " ".join(str(n) for n in seq_stats["bursts"]),
+                    ber_stats["bits"],
+                    ber_stats["bit_errors"],
+                    " ".join(str(n) for n in ber_stats["histogram"]),
+                    airtime_us,
+                    duty_cycle,
+                    rx_airtime["airtime_us"],
+                    tx_airtime["total_airtime_s"],
+                    tx_airtime["pps"],
+                    tx_airtime["goodput_bps"],
+                    rx_airtime["total_airtime_s"],
+                    rx_airtime["pps"],
+                    rx_airtime["goodput_bps"],
+                    fps,
+                    max_fps,
                 ]
             )
 
         print()
 
 
-async def read_logs(device):
-    print("reading logs")
+# Session record payload, see FS_SESSION_* in src/flash.h
+SESSION_SIZE = 16
+
+
+def decode_sessions(buffer):
+    sessions = []
+
+    for i in range(0, len(buffer) - SESSION_SIZE + 1, SESSION_SIZE):
+        s = buffer[i : i + SESSION_SIZE]
+        # Record count, then its complement
+        count = s[8] | s[9] << 8
+        count_complement = s[10] | s[11] << 8
+
+        sessions.append(
+            {
+                "id": s[0] | s[1] << 8 | s[2] << 16 | s[3] << 24,
+                "start_time_ms": s[4] | s[5] << 8 | s[6] << 16 | s[7] << 24,
+                "record_count": count if count ^ count_complement == 0xFFFF else None,
+                "mode": s[12],
+                "channel": s[13],
+                "tx_power": s[14],
+                "packet_size": s[15],
+            }
+        )
+
+    return sessions
+
+
+async def list_sessions(device):
+    async with BleakClient(device) as client:
+        buffer = await client.read_gatt_char(READ_SESSIONS_CHAR)
+        await client.disconnect()
+
+    return decode_sessions(buffer)
+
+
+# Per channel RX counters, see radio_channel_stats_write() in src/radio.c
+CHANNELS = 101
+CHANNEL_STATS_SIZE = 12
+
+
+def decode_channel_stats(buffer):
+    first, count = buffer[0], buffer[1]
+    channels = []
+
+    for i in range(count):
+        c = buffer[2 + i * CHANNEL_STATS_SIZE : 2 + (i + 1) * CHANNEL_STATS_SIZE]
+        packets = int.from_bytes(c[0:4], "little")
+        rssi = int.from_bytes(c[8:12], "little")
+
+        channels.append(
+            {
+                "channel": first + i,
+                "packets": packets,
+                "crc_ok": int.from_bytes(c[4:8], "little"),
+                "mean_rssi": -rssi / packets if packets else None,
+            }
+        )
+
+    return channels
+
+
+async def read_channels(device):
+    channels = []
+
+    async with BleakClient(device) as client:
+        # The characteristic returns a window of channels at a time
+        while len(channels) < CHANNELS:
+            await client.write_gatt_char(
+                SEND_COMMAND_CHAR,
+                bytearray([SELECT_CHANNELS_COMMAND, len(channels)]),
+                response=True,
+            )
+            window = decode_channel_stats(
+                await client.read_gatt_char(READ_CHANNELS_CHAR)
+            )
+            if not window:
+                break
+            channels.extend(window)
+
+        await client.disconnect()
+
+    return channels
+
+
+async def run_sweep(
+    device1, device2, tx_mode, tx_power, channel_start, channel_end, delay_ms, duration
+):
+    print(f"---------- STARTING SWEEP {tx_mode=} {channel_start}-{channel_end} -------------")
+
+    async with BleakClient(device1) as tx_client, BleakClient(device2) as rx_client:
+        for client in (tx_client, rx_client):
+            await client.write_gatt_char(
+                SEND_COMMAND_CHAR, bytearray([0x00, tx_mode]), response=False
+            )
+            await client.write_gatt_char(
+                SEND_COMMAND_CHAR, bytearray([0x01, tx_power]), response=False
+            )
+            await client.write_gatt_char(
+                SEND_COMMAND_CHAR, bytearray([0x02, channel_start]), response=False
+            )
+
+        # Both ends hop on their own timer, start them as close together as
+        # possible and dwell long enough for the offset not to matter
+        sweep = bytearray([channel_end]) + delay_ms.to_bytes(2, "little")
+        await rx_client.write_gatt_char(
+            SEND_COMMAND_CHAR, bytearray([START_RX_SWEEP_COMMAND]) + sweep, response=False
+        )
+        await tx_client.write_gatt_char(
+            SEND_COMMAND_CHAR, bytearray([START_TX_SWEEP_COMMAND]) + sweep, response=False
+        )
+
+        await asyncio.sleep(duration)
+
+        await tx_client.disconnect()
+        await rx_client.disconnect()
+
+
+# Round trip times, see radio_rtt_stats_write() in src/radio.c
+RTT_SUB_BINS = 8
+RTT_BINS = 120
+
+
+def decode_rtt_stats(buffer):
+    values = [
+        int.from_bytes(buffer[i : i + 4], "little") for i in range(0, len(buffer), 4)
+    ]
+
+    return {
+        "exchanges": values[0],
+        "lost": values[1],
+        "min_us": values[2],
+        "median_us": values[3],
+        "p99_us": values[4],
+        "max_us": values[5],
+        "mean_us": values[6],
+        "histogram": values[7 : 7 + RTT_BINS],
+    }
+
+
+async def run_ping(device1, device2, tx_mode, tx_power, tx_channel, packet_size, pings):
+    print(f"---------- STARTING PING {tx_mode=} {packet_size=} {pings=} -------------")
+
+    async with BleakClient(device1) as ping_client, BleakClient(device2) as pong_client:
+        for client in (ping_client, pong_client):
+            await client.write_gatt_char(
+                SEND_COMMAND_CHAR, bytearray([0x00, tx_mode]), response=False
+            )
+            await client.write_gatt_char(
+                SEND_COMMAND_CHAR, bytearray([0x01, tx_power]), response=False
+            )
+            await client.write_gatt_char(
+                SEND_COMMAND_CHAR, bytearray([0x02, tx_channel]), response=False
+            )
+            await client.write_gatt_char(
+                SEND_COMMAND_CHAR, bytearray([0x03, packet_size]), response=False
+            )
+        await ping_client.write_gatt_char(
+            SEND_COMMAND_CHAR,
+            bytearray([SET_PACKETS_NUM_COMMAND]) + pings.to_bytes(4, "little"),
+            response=False,
+        )
+
+        # The responder has to listen before the first ping
+        await pong_client.write_gatt_char(
+            SEND_COMMAND_CHAR, bytearray([START_PONG_COMMAND]), response=False
+        )
+        await asyncio.sleep(0.1)
+        await ping_client.write_gatt_char(
+            SEND_COMMAND_CHAR, bytearray([START_PING_COMMAND]), response=False
+        )
+
+        await ping_client.disconnect()
+        await pong_client.disconnect()
+
+    # Both wait 10 s before starting, the responder stops after 32 s
+    await asyncio.sleep(45)
+
+    async with BleakClient(device1) as client:
+        # Reports the mode set last
+        stats = decode_rtt_stats(await client.read_gatt_char(READ_LATENCY_CHAR))
+        await client.disconnect()
+
+    return stats
+
+
+# Acknowledged frames, see radio_ack_stats_write() in src/radio.c. They
+# follow the packet count, TX stats and airtime in the TX stats
+ACK_ATTEMPT_BINS = 16
+ACK_STATS_OFFSET = 36
+
+
+def decode_ack_stats(buffer):
+    values = [
+        int.from_bytes(buffer[i : i + 4], "little") for i in range(0, len(buffer), 4)
+    ]
+
+    return {
+        "attempts": values[0],
+        "delivered": values[1],
+        "failed": values[2],
+        "acks": values[3],
+        "duplicates": values[4],
+        "attempts_per_frame": values[5 : 5 + ACK_ATTEMPT_BINS],
+    }
+
+
+async def run_ack(device1, device2, tx_mode, tx_power, tx_channel, packet_size, frames, retries):
+    print(f"---------- STARTING ACK {tx_mode=} {packet_size=} {frames=} {retries=} -------------")
+
+    async with BleakClient(device1) as tx_client, BleakClient(device2) as rx_client:
+        for client in (tx_client, rx_client):
+            await client.write_gatt_char(
+                SEND_COMMAND_CHAR, bytearray([0x00, tx_mode]), response=False
+            )
+            await client.write_gatt_char(
+                SEND_COMMAND_CHAR, bytearray([0x01, tx_power]), response=False
+            )
+            await client.write_gatt_char(
+                SEND_COMMAND_CHAR, bytearray([0x02, tx_channel]), response=False
+            )
+            await client.write_gatt_char(
+                SEND_COMMAND_CHAR, bytearray([0x03, packet_size]), response=False
+            )
+        await tx_client.write_gatt_char(
+            SEND_COMMAND_CHAR,
+            bytearray([SET_PACKETS_NUM_COMMAND]) + frames.to_bytes(4, "little"),
+            response=False,
+        )
+        await tx_client.write_gatt_char(
+            SEND_COMMAND_CHAR, bytearray([SET_RETRIES_COMMAND, retries]), response=False
+        )
+
+        # The receiver has to listen before the first frame
+        await rx_client.write_gatt_char(
+            SEND_COMMAND_CHAR, bytearray([START_ACK_RX_COMMAND]), response=False
+        )
+        await asyncio.sleep(0.1)
+        await tx_client.write_gatt_char(
+            SEND_COMMAND_CHAR, bytearray([START_ACK_TX_COMMAND]), response=False
+        )
+
+        await tx_client.disconnect()
+        await rx_client.disconnect()
+
+    # Both wait 10 s before starting, the receiver stops after 32 s
+    await asyncio.sleep(45)
+
+    async with BleakClient(device1) as tx_client, BleakClient(device2) as rx_client:
+        tx_stats = await tx_client.read_gatt_char(READ_TX_STATS_CHAR)
+        rx_stats = await rx_client.read_gatt_char(READ_TX_STATS_CHAR)
+        await tx_client.disconnect()
+        await rx_client.disconnect()
+
+    return (
+        decode_airtime_stats(tx_stats[20 : 20 + AIRTIME_STATS_SIZE]),
+        decode_ack_stats(tx_stats[ACK_STATS_OFFSET:]),
+        decode_ack_stats(rx_stats[ACK_STATS_OFFSET:]),
+    )
+
+
+# Session 0 is the latest one
+async def read_logs(device, session_id=0):
+    print(f"reading logs of session {session_id}")
 
     byte_buffer = bytearray()
 
@@ -149,6 +630,11 @@ async def read_logs(device):
         byte_buffer.extend(bytes)
 
     async with BleakClient(device) as client:
+        await client.write_gatt_char(
+            SEND_COMMAND_CHAR,
+            bytearray([SELECT_SESSION_COMMAND]) + session_id.to_bytes(4, "little"),
+            response=False,
+        )
         await client.start_notify(READ_RX_STATS_CHAR, callback)
         await asyncio.sleep(5)
         await client.disconnect()
@@ -156,48 +642,103 @@ async def read_logs(device):
     return byte_buffer
 
 
+# Log record header, see FS_RECORD_* in src/flash.h
+RECORD_MAGIC = 0xAA
+RECORD_VERSION = 0x04
+RECORD_HEADER_SIZE = 8
+RECORD_TRAILER_SIZE = 4
+RECORD_CRC_SEED = 0xFFFF
+RECORD_COMMIT = 0x3CC3
+RECORD_TYPE_DATA = 0x0
+RECORD_TYPE_RX_EVENTS = 0x2
+
+# Per-packet RX event, see rx_events_drain() in radio.c
+RX_EVENT_SIZE = 8
+RX_EVENT_CRC_OK = 0x01
+
+
+def decode_events(record):
+    events = []
+
+    for j in range(0, len(record) - RX_EVENT_SIZE + 1, RX_EVENT_SIZE):
+        event = record[j : j + RX_EVENT_SIZE]
+        events.append(
+            {
+                "ticks": event[0] | event[1] << 8 | event[2] << 16 | event[3] << 24,
+                "rssi": event[4],
+                "crc_ok": bool(event[5] & RX_EVENT_CRC_OK),
+                "length": event[6],
+                "dropped_before": event[7],
+            }
+        )
+
+    return events
+
+
 def decode_buffer(buffer):
     packets = []
+    events = []
 
     i = 0
-    while i < len(buffer):
-        header = buffer[i : i + 5]
-
-        total_rssi = (
-            buffer[i + 5 + 0]
-            | buffer[i + 5 + 1] << 8
-            | buffer[i + 5 + 2] << 16
-            | buffer[i + 5 + 3] << 24
-        )
+    while i + RECORD_HEADER_SIZE <= len(buffer):
+        header = buffer[i : i + RECORD_HEADER_SIZE]
+
+        if header[0] != RECORD_MAGIC or header[1] != RECORD_VERSION:
+            print(f"Unknown record header {header.hex()} at {i}, stopping")
+            break
+
+        length = (header[2] | header[3] << 8) & 0x0FFF
+        record_type = header[3] >> 4
+        part = header[4] | header[5] << 8 | header[6] << 16 | header[7] << 24
+        record = buffer[i + RECORD_HEADER_SIZE : i + RECORD_HEADER_SIZE + length]
+
+        # Records are streamed as they are on flash, payloads padded to a
+        # multiple of 4 and followed by a trailer
+        padded_length = (length + 3) & ~3
+        record_size = RECORD_HEADER_SIZE + padded_length + RECORD_TRAILER_SIZE
+        trailer = buffer[i + record_size - RECORD_TRAILER_SIZE : i + record_size]
+
+        if len(trailer) < RECORD_TRAILER_SIZE:
+            print(f"Record {part} cut short at {i}, stopping")
+            break
+
+        crc = binascii.crc_hqx(bytes(header) + bytes(record), RECORD_CRC_SEED)
+        if (
+            trailer[0] | trailer[1] << 8 != crc
+            or trailer[2] | trailer[3] << 8 != RECORD_COMMIT
+        ):
+            print(f"Record {part} at {i} failed its CRC, skipping")
+            i += record_size
+            continue
+
+        if record_type == RECORD_TYPE_RX_EVENTS:
+            events.extend(decode_events(record))
+            i += record_size
+            continue
+
+        if record_type != RECORD_TYPE_DATA:
+            i += record_size
+            continue
+
+        total_rssi = record[0] | record[1] << 8 | record[2] << 16 | record[3] << 24
         packets_count = (
-            buffer[i + 5 + 4]
-            | buffer[i + 5 + 5] << 8
-            | buffer[i + 5 + 6] << 16
-            | buffer[i + 5 + 7] << 24
-        )
-        crc = (
-            buffer[i + 5 + 8]
-            | buffer[i + 5 + 9] << 8
-            | buffer[i + 5 + 10] << 16
-            | buffer[i + 5 + 11] << 24
-        )
-        ticks = (
-            buffer[i + 5 + 12]
-            | buffer[i + 5 + 13] << 8
-            | buffer[i + 5 + 14] << 16
-            | buffer[i + 5 + 15] << 24
+            record[4] | record[5] << 8 | record[6] << 16 | record[7] << 24
         )
+        crc = record[8] | record[9] << 8 | record[10] << 16 | record[11] << 24
+        ticks = record[12] | record[13] << 8 | record[14] << 16 | record[15] << 24
 
-        rssi = buffer[i + 5 + 16]
-        packet_size = buffer[i + 5 + 17]
-        packet = buffer[i + 5 + 18 : i + 5 + 18 + packet_size]
+        rssi = record[16]
+        packet_size = record[17]
+        rssi_stats = decode_rssi_stats(record[18 : 18 + RSSI_STATS_SIZE], packets_count)
+        packet = record[18 + RSSI_STATS_SIZE : 18 + RSSI_STATS_SIZE + packet_size]
 
         row = {
-            "part": buffer[i + 2],
+            "part": part,
             "total_rssi": total_rssi,
             "packet_count": packets_count,
             "crc": crc,
             "ticks": ticks,
+            "rssi_stats": rssi_stats,
         }
 
         pprint.pprint(row)
@@ -210,9 +751,9 @@ def decode_buffer(buffer):
 
         packets.append(row)
 
-        i += 5 + 18 + packet_size
+        i += record_size
 
-    return packets
+    return packets, events
 
 
 async def main():
@@ -226,7 +767,51 @@ async def main():
     device1 = await BleakScanner.find_device_by_address(PLATYNODE_1)
     device2 = await BleakScanner.find_device_by_address(PLATYNODE_2)
 
-    if len(sys.argv) > 1 and sys.argv[1] == "exp":
+    if len(sys.argv) > 1 and sys.argv[1] == "sessions":
+        for session in await list_sessions(device1):
+            print(session)
+    elif len(sys.argv) > 1 and sys.argv[1] == "sweep":
+        await run_sweep(device2, device1, tx_mode, tx_power, 0, 100, 100, 35)
+
+        with open(f"channels_{tx_mode}_{dist}.csv", "w", newline="") as f:
+            writer = csv.DictWriter(
+                f, fieldnames=["channel", "packets", "crc_ok", "mean_rssi"]
+            )
+            writer.writeheader()
+            writer.writerows(await read_channels(device1))
+    elif len(sys.argv) > 1 and sys.argv[1] == "ping":
+        with open(f"latency_{packet_size}_{dist}.csv", "w", newline="") as f:
+            writer = csv.writer(f)
+            writer.writerow(
+                ["mode", "exchanges", "lost", "min_us", "median_us", "p99_us", "max_us", "mean_us", "histogram"]
+            )
+            for mode in range(7):
+                stats = await run_ping(
+                    device2, device1, mode, tx_power, tx_channel, packet_size, 1000
+                )
+                print(mode, stats)
+                writer.writerow(
+                    [mode]
+                    + [v for k, v in stats.items() if k != "histogram"]
+                    + [" ".join(str(n) for n in stats["histogram"])]
+                )
+    elif len(sys.argv) > 1 and sys.argv[1] == "ack":
+        with open(f"ack_{packet_size}_{dist}.csv", "w", newline="") as f:
+            writer = csv.writer(f)
+            writer.writerow(
+                ["mode", "retries", "attempts", "delivered", "failed", "goodput_bps", "rx_frames", "rx_acks", "rx_duplicates", "attempts_per_frame"]
+            )
+            for retries in (0, 1, 3):
+                airtime, tx, rx = await run_ack(
+                    device2, device1, tx_mode, tx_power, tx_channel, packet_size, 1000, retries
+                )
+                print(retries, tx, rx)
+                writer.writerow(
+                    [tx_mode, retries, tx["attempts"], tx["delivered"], tx["failed"], airtime["goodput_bps"]]
+                    + [rx["attempts"], rx["acks"], rx["duplicates"]]
+                    + [" ".join(str(n) for n in tx["attempts_per_frame"])]
+                )
+    elif len(sys.argv) > 1 and sys.argv[1] == "exp":
         print("Starting experiment")
         await run_test(
             device2,
@@ -246,8 +831,18 @@ async def main():
             packet_size,
             f"results_{tx_mode}_{tx_channel}_{dist}.csv",
         )
-        buffer = await read_logs(device1)
-        packets = decode_buffer(buffer)
+        session_id = int(sys.argv[1]) if len(sys.argv) > 1 else 0
+        buffer = await read_logs(device1, session_id)
+        packets, events = decode_buffer(buffer)
+
+        with open(
+            f"events_{tx_mode}_{tx_channel}_{dist}.csv", "w", newline=""
+        ) as f:
+            writer = csv.DictWriter(
+                f, fieldnames=["ticks", "rssi", "crc_ok", "length", "dropped_before"]
+            )
+            writer.writeheader()
+            writer.writerows(events)
 
         with open(
             f"raw_log_buffer_{tx_mode}_{tx_channel}_{dist}.bin", "wb"
@@ -0,0 +1,472 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <zephyr/drivers/flash.h>
+#include <zephyr/kernel.h>
+
+#include "flash.h"
+#include "flash_emu.h"
+
+// A 31 s RX test logs a snapshot every 250 ms, each one the 18 byte stats
+// header of radio.c followed by the last packet
+#define BENCH_RECORDS_PER_SESSION 124
+#define BENCH_PACKET_SIZE 128
+
+#define BENCH_LISTED_SESSIONS 64
+
+// ATT payload of a notification at the default 23 byte MTU, the smallest
+// chunk send_all_logs() sends
+#define BENCH_CHUNK_SIZE 20
+
+static double bench_seconds(uint64_t start_ns)
+{
+    return (host_monotonic_ns() - start_ns) / 1e9;
+}
+
+static void bench_print_flash(const char *phase, uint32_t records)
+{
+    printf("bench: %s flash: %u reads (%.2f/record, %llu bytes), %u page programs "
+           "(%.2f/record, %llu bytes), %u sector erases\n",
+           phase,
+           flash_emu_stats.reads, (double)flash_emu_stats.reads / MAX(records, 1),
+           (unsigned long long)flash_emu_stats.bytes_read,
+           flash_emu_stats.programs, (double)flash_emu_stats.programs / MAX(records, 1),
+           (unsigned long long)flash_emu_stats.bytes_programmed,
+           flash_emu_stats.sector_erases);
+}
+
+// Logs `sessions` sessions the way receive_rx_packets() does
+static int bench_write(struct device *d, uint32_t sessions, uint32_t records, uint16_t len)
+{
+    uint8_t buf[FS_RECORD_LEN_MASK];
+    uint32_t written = 0;
+
+    memset(buf, 0x5a, len);
+    memset(&flash_emu_stats, 0, sizeof(flash_emu_stats));
+
+    uint64_t start = host_monotonic_ns();
+
+    for (uint32_t s = 0; s < sessions; s++)
+    {
+        fs_session_t session = {
+            .mode = s % 7,
+            .channel = s % 100,
+            .tx_power = 8,
+            .packet_size = len - 18,
+        };
+
+        if (fs_session_start(d, &session) != 0)
+        {
+            printf("bench: fs_session_start failed\n");
+            return -1;
+        }
+
+        for (uint32_t i = 0; i < records; i++)
+        {
+            // Tag each record so reads can be checked
+            memcpy(buf, &session.id, 4);
+            memcpy(buf + 4, &i, 4);
+
+            if (fs_write_packet(d, buf, len) != 0)
+            {
+                printf("bench: fs_write_packet failed\n");
+                return -1;
+            }
+
+            written++;
+        }
+
+        if (fs_session_end(d) != 0)
+        {
+            printf("bench: fs_session_end failed\n");
+            return -1;
+        }
+    }
+
+    double t = bench_seconds(start);
+
+    printf("bench: wrote %u sessions, %u records of %u bytes in %.3f s: %.0f records/s, %.1f MB/s\n",
+           sessions, written, len, t, written / t, written * (double)len / t / 1e6);
+    printf("bench: write log: %u flash writes, %u sectors erased, %u erase waits\n",
+           fs_metrics.flash_writes, fs_metrics.sectors_erased, fs_metrics.erase_waits);
+    bench_print_flash("write", written);
+    return 0;
+}
+
+static int bench_check_record(const fs_session_t *session, uint32_t part, const uint8_t *record)
+{
+    uint32_t id;
+    uint32_t i;
+
+    memcpy(&id, record + FS_HEADER_SIZE, 4);
+    memcpy(&i, record + FS_HEADER_SIZE + 4, 4);
+
+    if (id != session->id || i != part - 1)
+    {
+        printf("bench: session %u part %u holds session %u record %u\n",
+               session->id, part, id, i);
+        return -1;
+    }
+
+    return 0;
+}
+
+static int bench_check_count(const fs_session_t *session, uint32_t count)
+{
+    if (session->record_count != FS_SESSION_COUNT_UNKNOWN && session->record_count != count)
+    {
+        printf("bench: session %u read %u of %u records\n",
+               session->id, count, session->record_count);
+        return -1;
+    }
+
+    return 0;
+}
+
+// Size on flash of the record whose header is in `header`
+static uint16_t bench_record_size(const uint8_t *header)
+{
+    uint16_t len = (header[2] | header[3] << 8) & FS_RECORD_LEN_MASK;
+
+    return FS_HEADER_SIZE + ROUND_UP(len, 4) + FS_TRAILER_SIZE;
+}
+
+// Reads a session part by part through the index
+static int bench_read_parts(struct device *d, const fs_session_t *session, uint32_t *count)
+{
+    static uint8_t buf[FS_HEADER_SIZE + FS_RECORD_LEN_MASK];
+    flash_read_t result;
+    uint32_t part = 1;
+
+    while ((result = fs_read(d, buf, part)).res == FS_SUCCESS)
+    {
+        if (bench_check_record(session, part, buf) != 0)
+        {
+            return -1;
+        }
+
+        part++;
+    }
+
+    *count = part - 1;
+    return result.res == FS_EOF ? bench_check_count(session, *count) : -1;
+}
+
+// Streams a session in notification sized chunks and reassembles the records
+// the way host.py does
+static int bench_read_cursor(struct device *d, const fs_session_t *session, uint32_t *count)
+{
+    static uint8_t stream[FLASH_SECTOR_SIZE + BENCH_CHUNK_SIZE];
+    uint16_t stream_len = 0;
+    uint32_t part = 1;
+    fs_cursor_t cursor;
+    int n;
+
+    if (fs_cursor_open(d, &cursor) != 0)
+    {
+        return -1;
+    }
+
+    while ((n = fs_cursor_next_chunk(d, &cursor, stream + stream_len, BENCH_CHUNK_SIZE)) > 0)
+    {
+        stream_len += n;
+
+        while (stream_len >= FS_HEADER_SIZE)
+        {
+            uint16_t size = bench_record_size(stream);
+
+            if (stream_len < size)
+            {
+                break;
+            }
+
+            if (bench_check_record(session, part, stream) != 0)
+            {
+                return -1;
+            }
+
+            memmove(stream, stream + size, stream_len - size);
+            stream_len -= size;
+            part++;
+        }
+    }
+
+    fs_cursor_close(&cursor);
+
+    *count = part - 1;
+    return n == 0 && stream_len == 0 ? bench_check_count(session, *count) : -1;
+}
+
+// Downloads every listed session, once through `fs_read()` and once through
+// a cursor the way send_all_logs() does
+static int bench_read(struct device *d)
+{
+    static fs_session_t sessions[BENCH_LISTED_SESSIONS];
+    int (*const methods[])(struct device *, const fs_session_t *, uint32_t *) = {
+        bench_read_parts,
+        bench_read_cursor,
+    };
+    const char *const names[] = {"read parts", "read cursor"};
+
+    memset(&flash_emu_stats, 0, sizeof(flash_emu_stats));
+
+    uint64_t start = host_monotonic_ns();
+
+    int n = fs_session_list(d, sessions, BENCH_LISTED_SESSIONS);
+    if (n < 0)
+    {
+        printf("bench: fs_session_list failed\n");
+        return -1;
+    }
+
+    printf("bench: listed %d sessions in %.3f ms with %u reads\n",
+           n, bench_seconds(start) * 1e3, flash_emu_stats.reads);
+
+    for (int m = 0; m < 2; m++)
+    {
+        uint32_t read = 0;
+
+        memset(&flash_emu_stats, 0, sizeof(flash_emu_stats));
+        start = host_monotonic_ns();
+
+        for (int s = 0; s < n; s++)
+        {
+            uint32_t count;
+
+            fs_session_select(d, sessions[s].id);
+
+            if (methods[m](d, &sessions[s], &count) != 0)
+            {
+                printf("bench: %s failed on session %u\n", names[m], sessions[s].id);
+                return -1;
+            }
+
+            read += count;
+        }
+
+        double t = bench_seconds(start);
+
+        printf("bench: %s: %d sessions, %u records in %.3f s: %.0f records/s\n",
+               names[m], n, read, t, read / t);
+        bench_print_flash(names[m], read);
+    }
+
+    return 0;
+}
+
+// Walks the headers of a log that hasn't wrapped around for its last record,
+// -1 if it has none
+static off_t bench_last_record(struct device *d)
+{
+    uint8_t header[FS_HEADER_SIZE];
+    off_t offset = 0;
+    off_t last = -1;
+
+    while (offset + FS_HEADER_SIZE <= FS_LOG_SIZE &&
+           flash_read(d, offset, header, FS_HEADER_SIZE) == 0)
+    {
+        if (header[0] == FS_RECORD_MAGIC)
+        {
+            last = offset;
+            offset += bench_record_size(header);
+        }
+        else if (offset % FLASH_SECTOR_SIZE != 0)
+        {
+            // Erased or sealed tail of a sector
+            offset = ROUND_UP(offset, FLASH_SECTOR_SIZE);
+        }
+        else
+        {
+            break;
+        }
+    }
+
+    return last;
+}
+
+// Logs `records` records into a session that a reset cuts short while the
+// trailer of the last one is being programmed
+static int bench_tear(struct device *d, uint32_t records, uint16_t len)
+{
+    uint8_t buf[FS_RECORD_LEN_MASK];
+    fs_session_t session = {
+        .tx_power = 8,
+        .packet_size = len - 18,
+    };
+
+    memset(buf, 0x5a, len);
+
+    if (fs_session_start(d, &session) != 0)
+    {
+        printf("bench: fs_session_start failed\n");
+        return -1;
+    }
+
+    for (uint32_t i = 0; i < records; i++)
+    {
+        memcpy(buf, &session.id, 4);
+        memcpy(buf + 4, &i, 4);
+
+        if (fs_write_packet(d, buf, len) != 0)
+        {
+            printf("bench: fs_write_packet failed\n");
+            return -1;
+        }
+    }
+
+    if (fs_flush(d) != 0)
+    {
+        printf("bench: fs_flush failed\n");
+        return -1;
+    }
+
+    // A torn record starting a sector gets its sector erased instead of
+    // sealed
+    off_t last = bench_last_record(d);
+    if (last <= 0 || last % FLASH_SECTOR_SIZE == 0)
+    {
+        printf("bench: the last record has to follow another one in its sector\n");
+        return -1;
+    }
+
+    uint8_t header[FS_HEADER_SIZE];
+    flash_read(d, last, header, FS_HEADER_SIZE);
+    flash_emu_tear(d, last + bench_record_size(header) - FS_TRAILER_SIZE, FS_TRAILER_SIZE);
+
+    printf("bench: tore the trailer of session %u record %u at %ld\n",
+           session.id, records - 1, (long)last);
+    return 0;
+}
+
+// Boots into the log `bench_tear()` left: the torn record has to be counted,
+// sealed and left out of its session, and logging has to carry on after it
+static int bench_torn(struct device *d, uint32_t records, uint16_t len)
+{
+    fs_session_t session;
+    uint8_t header[FS_HEADER_SIZE];
+    uint8_t seal[4];
+    uint32_t count;
+
+    if (fs_metrics.torn_records != 1)
+    {
+        printf("bench: found %u torn records instead of 1\n", fs_metrics.torn_records);
+        return -1;
+    }
+
+    // Once sealed the torn record reads as the tail of its sector, so the
+    // walk stops at the record in front of it
+    off_t last = bench_last_record(d);
+    if (last < 0)
+    {
+        printf("bench: no records left\n");
+        return -1;
+    }
+
+    flash_read(d, last, header, FS_HEADER_SIZE);
+    off_t torn = last + bench_record_size(header);
+    flash_read(d, torn, seal, sizeof(seal));
+
+    if (seal[0] != 0 || seal[1] != 0 || seal[2] != 0 || seal[3] != 0)
+    {
+        printf("bench: torn record at %ld is not sealed\n", (long)torn);
+        return -1;
+    }
+
+    if (fs_session_list(d, &session, 1) != 1)
+    {
+        printf("bench: fs_session_list failed\n");
+        return -1;
+    }
+
+    fs_session_select(d, session.id);
+
+    if (bench_read_parts(d, &session, &count) != 0 || count != records - 1)
+    {
+        printf("bench: session %u read back %u records instead of %u\n",
+               session.id, count, records - 1);
+        return -1;
+    }
+
+    printf("bench: torn record at %ld sealed, session %u keeps %u records\n",
+           (long)torn, session.id, count);
+
+    // The next session starts after the sealed record and reads back whole,
+    // next to the torn one
+    if (bench_write(d, 1, records, len) != 0)
+    {
+        return -1;
+    }
+
+    return bench_read(d);
+}
+
+static void usage(void)
+{
+    printf("usage: bench write <image> [sessions [records [packet size]]]\n"
+           "       bench read <image>\n"
+           "       bench tear <image> [records [packet size]]\n"
+           "       bench torn <image> [records [packet size]]\n");
+}
+
+int main(int argc, char **argv)
+{
+    if (argc < 3)
+    {
+        usage();
+        return 2;
+    }
+
+    fs_flash_device = flash_emu_open(argv[2]);
+    if (fs_flash_device == NULL)
+    {
+        printf("bench: could not map %s\n", argv[2]);
+        return 1;
+    }
+
+    // Boot, the image may hold a log from an earlier run
+    fs_init();
+
+    printf("bench: located end of log in %u us with %u reads\n",
+           fs_metrics.locate_end_us, fs_metrics.locate_end_reads);
+
+    int err;
+
+    if (strcmp(argv[1], "write") == 0)
+    {
+        uint32_t sessions = argc > 3 ? strtoul(argv[3], NULL, 0) : 1000;
+        uint32_t records = argc > 4 ? strtoul(argv[4], NULL, 0) : BENCH_RECORDS_PER_SESSION;
+        uint32_t packet_size = argc > 5 ? strtoul(argv[5], NULL, 0) : BENCH_PACKET_SIZE;
+
+        err = bench_write(fs_flash_device, sessions, records,
+                          MIN(18 + packet_size, FS_RECORD_LEN_MASK));
+    }
+    else if (strcmp(argv[1], "read") == 0)
+    {
+        err = bench_read(fs_flash_device);
+    }
+    else if (strcmp(argv[1], "tear") == 0 || strcmp(argv[1], "torn") == 0)
+    {
+        uint32_t records = argc > 3 ? strtoul(argv[3], NULL, 0) : BENCH_RECORDS_PER_SESSION;
+        uint32_t packet_size = argc > 4 ? strtoul(argv[4], NULL, 0) : BENCH_PACKET_SIZE;
+        uint16_t len = MIN(18 + packet_size, FS_RECORD_LEN_MASK);
+
+        err = strcmp(argv[1], "tear") == 0 ? bench_tear(fs_flash_device, records, len)
+                                           : bench_torn(fs_flash_device, records, len);
+    }
+    else
+    {
+        usage();
+        err = 2;
+    }
+
+    if (flash_emu_stats.rejected != 0 || flash_emu_stats.overprograms != 0)
+    {
+        printf("bench: %u flash calls rejected, %u overprograms\n",
+               flash_emu_stats.rejected, flash_emu_stats.overprograms);
+        err = 1;
+    }
+
+    flash_emu_close(fs_flash_device);
+    return err != 0;
+}
@@ -0,0 +1,150 @@
+#include "flash_emu.h"
+
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <zephyr/drivers/flash.h>
+#include <zephyr/kernel.h>
+
+#include "flash.h"
+
+// NOR flash behind the QSPI driver, see zephyr/drivers/flash/nrf_qspi_nor.c
+// for the argument checks copied here
+
+flash_emu_stats_t flash_emu_stats;
+
+static struct device flash_emu_device = {
+    .name = "flash_emu",
+    .data = NULL,
+};
+
+static int flash_emu_fd = -1;
+
+struct device *flash_emu_open(const char *path)
+{
+    struct stat st;
+
+    flash_emu_fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (flash_emu_fd < 0 || fstat(flash_emu_fd, &st) != 0)
+    {
+        return NULL;
+    }
+
+    bool fresh = st.st_size != FLASH_SIZE;
+    if (fresh && ftruncate(flash_emu_fd, FLASH_SIZE) != 0)
+    {
+        return NULL;
+    }
+
+    void *mem = mmap(NULL, FLASH_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, flash_emu_fd, 0);
+    if (mem == MAP_FAILED)
+    {
+        return NULL;
+    }
+
+    // Flash comes erased
+    if (fresh)
+    {
+        memset(mem, 0xff, FLASH_SIZE);
+    }
+
+    memset(&flash_emu_stats, 0, sizeof(flash_emu_stats));
+    flash_emu_device.data = mem;
+    return &flash_emu_device;
+}
+
+void flash_emu_close(struct device *dev)
+{
+    if (dev->data != NULL)
+    {
+        msync(dev->data, FLASH_SIZE, MS_SYNC);
+        munmap(dev->data, FLASH_SIZE);
+        dev->data = NULL;
+    }
+
+    if (flash_emu_fd >= 0)
+    {
+        close(flash_emu_fd);
+        flash_emu_fd = -1;
+    }
+}
+
+static bool flash_emu_in_range(off_t offset, size_t len)
+{
+    return offset >= 0 && len <= FLASH_SIZE && offset <= FLASH_SIZE - (off_t)len;
+}
+
+void flash_emu_tear(struct device *dev, off_t offset, size_t len)
+{
+    if (flash_emu_in_range(offset, len))
+    {
+        memset((uint8_t *)dev->data + offset, 0xff, len);
+    }
+}
+
+int flash_read(const struct device *dev, off_t offset, void *data, size_t len)
+{
+    if (len == 0 || !flash_emu_in_range(offset, len))
+    {
+        flash_emu_stats.rejected++;
+        return -EINVAL;
+    }
+
+    // Unaligned reads are bounced through an aligned buffer by the driver,
+    // still a single transfer
+    memcpy(data, (uint8_t *)dev->data + offset, len);
+
+    flash_emu_stats.reads++;
+    flash_emu_stats.bytes_read += len;
+    return 0;
+}
+
+int flash_write(const struct device *dev, off_t offset, const void *data, size_t len)
+{
+    // Sizes of up to 4 bytes are padded by the driver, anything longer has to
+    // be whole words, at a word aligned address
+    if (len == 0 || (len > 4 && len % 4 != 0) || offset % 4 != 0 ||
+        !flash_emu_in_range(offset, len))
+    {
+        flash_emu_stats.rejected++;
+        return -EINVAL;
+    }
+
+    uint8_t *mem = (uint8_t *)dev->data + offset;
+    const uint8_t *buf = data;
+    bool overprogram = false;
+
+    // Programming can only clear bits
+    for (size_t i = 0; i < len; i++)
+    {
+        overprogram |= (buf[i] & ~mem[i]) != 0;
+        mem[i] &= buf[i];
+    }
+
+    flash_emu_stats.overprograms += overprogram;
+
+    // The QSPI peripheral splits writes at page boundaries, one program
+    // command per page
+    flash_emu_stats.programs += (offset + len - 1) / FLASH_PAGE_SIZE - offset / FLASH_PAGE_SIZE + 1;
+    flash_emu_stats.bytes_programmed += len;
+    return 0;
+}
+
+int flash_erase(const struct device *dev, off_t offset, size_t size)
+{
+    if (offset % FLASH_SECTOR_SIZE != 0 || size % FLASH_SECTOR_SIZE != 0 ||
+        !flash_emu_in_range(offset, size))
+    {
+        flash_emu_stats.rejected++;
+        return -EINVAL;
+    }
+
+    memset((uint8_t *)dev->data + offset, 0xff, size);
+
+    // The log erases from its own thread as well
+    __atomic_fetch_add(&flash_emu_stats.sector_erases, size / FLASH_SECTOR_SIZE, __ATOMIC_RELAXED);
+    return 0;
+}
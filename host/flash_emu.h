@@ -0,0 +1,43 @@
+#ifndef _FLASH_EMU_H_
+#define _FLASH_EMU_H_
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include <zephyr/device.h>
+
+typedef struct
+{
+    // Read commands, and bytes read by them
+    uint32_t reads;
+    uint64_t bytes_read;
+
+    // Page program commands, one per page a write touches, and bytes written
+    uint32_t programs;
+    uint64_t bytes_programmed;
+
+    // Sectors erased
+    uint32_t sector_erases;
+
+    // Calls the QSPI NOR driver would have refused with -EINVAL
+    uint32_t rejected;
+
+    // Programs that tried to turn a 0 bit back into a 1, which NOR flash
+    // silently ignores. Always a bug in the caller.
+    uint32_t overprograms;
+} flash_emu_stats_t;
+
+extern flash_emu_stats_t flash_emu_stats;
+
+// Maps `path` as the FLASH_SIZE flash, creating it fully erased if it is
+// missing or has the wrong size. The contents persist across runs, so
+// reopening the file is a reboot.
+struct device *flash_emu_open(const char *path);
+
+void flash_emu_close(struct device *dev);
+
+// Sets `len` bytes at `offset` back to erased, as if a reset had stopped
+// them from being programmed. Nothing the log could do itself.
+void flash_emu_tear(struct device *dev, off_t offset, size_t len);
+
+#endif
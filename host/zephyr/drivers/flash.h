@@ -0,0 +1,14 @@
+#ifndef _HOST_ZEPHYR_DRIVERS_FLASH_H_
+#define _HOST_ZEPHYR_DRIVERS_FLASH_H_
+
+#include <stddef.h>
+#include <sys/types.h>
+
+#include <zephyr/device.h>
+
+// Implemented by flash_emu.c with the semantics of the QSPI NOR driver
+int flash_read(const struct device *dev, off_t offset, void *data, size_t len);
+int flash_write(const struct device *dev, off_t offset, const void *data, size_t len);
+int flash_erase(const struct device *dev, off_t offset, size_t size);
+
+#endif
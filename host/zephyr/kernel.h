@@ -0,0 +1,137 @@
+#ifndef _HOST_ZEPHYR_KERNEL_H_
+#define _HOST_ZEPHYR_KERNEL_H_
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+// The parts of the Zephyr kernel API src/flash.c uses, on top of pthreads
+
+#define printk(...) printf(__VA_ARGS__)
+
+#define ROUND_UP(x, align) \
+    ((((unsigned long)(x) + ((unsigned long)(align) - 1)) / (unsigned long)(align)) * (unsigned long)(align))
+#define MIN(a, b) (((a) < (b)) ? (a) : (b))
+#define MAX(a, b) (((a) > (b)) ? (a) : (b))
+#define ARG_UNUSED(x) (void)(x)
+
+#define K_FOREVER (-1)
+
+static inline uint64_t host_monotonic_ns(void)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (uint64_t)t.tv_sec * 1000000000 + t.tv_nsec;
+}
+
+// One cycle per nanosecond
+static inline uint32_t k_cycle_get_32(void)
+{
+    return (uint32_t)host_monotonic_ns();
+}
+
+static inline uint32_t k_cyc_to_us_floor32(uint32_t cycles)
+{
+    return cycles / 1000;
+}
+
+static inline uint32_t k_uptime_get_32(void)
+{
+    return (uint32_t)(host_monotonic_ns() / 1000000);
+}
+
+// Zephyr mutexes can be locked again by their owner
+struct k_mutex
+{
+    pthread_mutex_t mutex;
+};
+
+#define K_MUTEX_DEFINE(name) \
+    struct k_mutex name = {PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP}
+
+static inline int k_mutex_lock(struct k_mutex *m, int timeout)
+{
+    ARG_UNUSED(timeout);
+    return pthread_mutex_lock(&m->mutex);
+}
+
+static inline int k_mutex_unlock(struct k_mutex *m)
+{
+    return pthread_mutex_unlock(&m->mutex);
+}
+
+struct k_condvar
+{
+    pthread_cond_t cond;
+};
+
+#define K_CONDVAR_DEFINE(name) \
+    struct k_condvar name = {PTHREAD_COND_INITIALIZER}
+
+static inline int k_condvar_wait(struct k_condvar *c, struct k_mutex *m, int timeout)
+{
+    ARG_UNUSED(timeout);
+    return pthread_cond_wait(&c->cond, &m->mutex);
+}
+
+static inline int k_condvar_broadcast(struct k_condvar *c)
+{
+    return pthread_cond_broadcast(&c->cond);
+}
+
+struct k_sem
+{
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    unsigned int count;
+    unsigned int limit;
+};
+
+#define K_SEM_DEFINE(name, initial_count, count_limit)                    \
+    struct k_sem name = {PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, \
+                         (initial_count), (count_limit)}
+
+static inline void k_sem_give(struct k_sem *s)
+{
+    pthread_mutex_lock(&s->mutex);
+    if (s->count < s->limit)
+    {
+        s->count++;
+    }
+    pthread_cond_signal(&s->cond);
+    pthread_mutex_unlock(&s->mutex);
+}
+
+static inline int k_sem_take(struct k_sem *s, int timeout)
+{
+    ARG_UNUSED(timeout);
+
+    pthread_mutex_lock(&s->mutex);
+    while (s->count == 0)
+    {
+        pthread_cond_wait(&s->cond, &s->mutex);
+    }
+    s->count--;
+    pthread_mutex_unlock(&s->mutex);
+    return 0;
+}
+
+// Threads are started before main(), like Zephyr starts them before the
+// application runs. Stack size, priority and delay have no host equivalent.
+#define K_THREAD_DEFINE(name, stack_size, entry, p1, p2, p3, prio, options, delay) \
+    static void *name##_host_entry(void *arg)                                       \
+    {                                                                               \
+        ARG_UNUSED(arg);                                                            \
+        ((void (*)(void))(entry))();                                                \
+        return NULL;                                                                \
+    }                                                                               \
+    __attribute__((constructor)) static void name##_host_start(void)               \
+    {                                                                               \
+        pthread_t thread;                                                           \
+        pthread_create(&thread, NULL, name##_host_entry, NULL);                     \
+        pthread_detach(thread);                                                     \
+    }
+
+#endif
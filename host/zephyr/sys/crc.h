@@ -0,0 +1,23 @@
+#ifndef _HOST_ZEPHYR_SYS_CRC_H_
+#define _HOST_ZEPHYR_SYS_CRC_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Same as Zephyr's lib/os/crc16_sw.c
+static inline uint16_t crc16_itu_t(uint16_t seed, const uint8_t *src, size_t len)
+{
+    for (; len > 0; len--)
+    {
+        uint8_t e = seed >> 8;
+        uint8_t f;
+
+        e ^= *src++;
+        f = e ^ (e >> 4);
+        seed = (seed << 8) ^ ((uint16_t)f << 12) ^ ((uint16_t)f << 5) ^ f;
+    }
+
+    return seed;
+}
+
+#endif
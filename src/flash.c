@@ -2,188 +2,1637 @@
 
 #include <zephyr/drivers/flash.h>
 #include <zephyr/kernel.h>
+#include <zephyr/sys/crc.h>
 #include <string.h>
 
+#define FS_ERASE_THREAD_STACKSIZE 512
+#define FS_ERASE_THREAD_PRIORITY 10
+
 static off_t fs_offset = 0;
-static uint8_t current_part = 0;
+static uint32_t current_part = 0;
 static bool reached_end = false;
 
+// Staging buffer for the page `fs_offset` is in. Bytes from
+// `fs_staged_offset` up to `fs_offset` have not been written to flash yet.
+static uint8_t fs_page_buf[FLASH_PAGE_SIZE];
+static off_t fs_staged_offset = 0;
+
+// Sectors are counted since boot instead of by position, so these never wrap
+// around the ring. The write position is in sector `fs_head_sector`, every
+// sector before `fs_erased_sectors` has been erased.
+static uint32_t fs_head_sector = 0;
+static uint32_t fs_erased_sectors = 0;
+static bool fs_erasing = false;
+
+static K_MUTEX_DEFINE(fs_mutex);
+
+// Signalled after every sector erase, for writers that caught up with it
+static K_CONDVAR_DEFINE(fs_erased_cond);
+
+// Wakes up the erase thread whenever the write position enters a new sector
+static K_SEM_DEFINE(fs_erase_sem, 0, 1);
+
+// In-RAM index of the records of the selected session, `fs_index[part - 1]`
+// locates `part`. Built by the first `fs_read()` after boot or selecting a
+// session, and appended to by `fs_write_packet()` while following the latest
+// session, so reading a part never has to walk the headers in front of it.
+// Only the first `FS_INDEX_SIZE` parts are indexed, the ones after are found
+// by walking on from the last indexed part.
+typedef struct
+{
+    uint32_t offset;
+    uint16_t len;
+} fs_index_entry_t;
+
+static fs_index_entry_t fs_index[FS_INDEX_SIZE];
+static uint16_t fs_index_len = 0;
+static bool fs_index_built = false;
+
+// Session `fs_read()` returns the parts of, 0 follows the latest session
+static uint32_t fs_selected_session = 0;
+
+// Session directory, see FS_DIR_* in flash.h. New entries go into sector
+// `fs_dir_sector` of the directory, which holds `fs_dir_len` of them.
+static uint8_t fs_dir_sector = 0;
+static uint16_t fs_dir_len = 0;
+
+// Id of the first entry in each directory sector, 0 if it has none
+static uint32_t fs_dir_first_id[FS_DIR_SECTORS];
+static uint32_t fs_next_session_id = 1;
+
+// Session record of the running session, for `fs_session_end()`
+static off_t fs_session_offset = -1;
+static uint32_t fs_session_records = 0;
+
+// Offset of the record count in the session record payload
+#define FS_SESSION_COUNT_OFFSET 8
+
+fs_metrics_t fs_metrics;
+
 // XXX: this should ideally be checked for `device_is_ready()` at startup
 struct device *fs_flash_device = NULL;
 
-uint16_t round_to_pow2(uint16_t v)
+typedef struct
+{
+    uint16_t len;
+    fs_record_type_t type;
+    uint32_t part;
+} fs_header_t;
+
+typedef struct
+{
+    uint32_t id;
+    uint32_t offset;
+    uint32_t part;
+} fs_dir_entry_t;
+
+static void fs_put_u32(uint8_t *buf, uint32_t value)
 {
-    // See https://graphics.stanford.edu/%7Eseander/bithacks.html#RoundUpPowerOf2
-    v--;
-    v |= v >> 1;
-    v |= v >> 2;
-    v |= v >> 4;
-    v |= v >> 8;
-    return v + 1;
+    buf[0] = value & 0xff;
+    buf[1] = (value >> 8) & 0xff;
+    buf[2] = (value >> 16) & 0xff;
+    buf[3] = (value >> 24) & 0xff;
 }
 
-int fs_erase(struct device *d, uint8_t sectors)
+static uint32_t fs_get_u32(const uint8_t *buf)
 {
-    return flash_erase(d, 0, sectors * 4096);
+    return buf[0] | buf[1] << 8 | buf[2] << 16 | (uint32_t)buf[3] << 24;
 }
 
-void fs_init(void)
+// Payloads are only padded to the word size qspi_nor_write() requires,
+// see zephyr/drivers/flash/nrf_qspi_nor.c
+static uint16_t fs_record_size(uint16_t len)
 {
-    printk("fs_init: Getting QSPI flash\n");
-    if (fs_flash_device == NULL)
+    return FS_HEADER_SIZE + ROUND_UP(len, 4) + FS_TRAILER_SIZE;
+}
+
+static off_t fs_sector_start(uint32_t sector)
+{
+    return (off_t)(sector % FS_LOG_SECTORS) * FLASH_SECTOR_SIZE;
+}
+
+static void fs_index_append(off_t offset, uint16_t len)
+{
+    if (fs_index_len == FS_INDEX_SIZE)
     {
-        fs_flash_device = DEVICE_DT_GET(DT_ALIAS(spi_flash0));
-        while (!device_is_ready(fs_flash_device))
-        {
-        }
+        return;
     }
+
+    fs_index[fs_index_len].offset = offset;
+    fs_index[fs_index_len].len = len;
+    fs_index_len++;
 }
 
-flash_read_t fs_read(struct device *d,
-                     uint8_t *buf,
-                     uint8_t part)
+static bool fs_is_header(const uint8_t *header_buf)
 {
-    flash_read_t ret;
+    return header_buf[0] == FS_RECORD_MAGIC && header_buf[1] == FS_RECORD_VERSION;
+}
 
-    uint16_t len = 0;
-    uint8_t header_buf[5];
-    off_t offset = 0;
+static void fs_parse_header(const uint8_t *header_buf, fs_header_t *header)
+{
+    uint16_t len_type = header_buf[2] | header_buf[3] << 8;
 
-    if (!device_is_ready(d))
+    header->len = len_type & FS_RECORD_LEN_MASK;
+    header->type = len_type >> FS_RECORD_TYPE_SHIFT;
+    header->part = fs_get_u32(header_buf + 4);
+}
+
+// Reads the header at `offset`, `*valid` is false if there is no record there
+static int fs_read_header(struct device *d, off_t offset, fs_header_t *header, bool *valid)
+{
+    uint8_t header_buf[FS_HEADER_SIZE];
+
+    int err = flash_read(d, offset, header_buf, FS_HEADER_SIZE);
+    if (err != 0)
     {
-        ret.res = FS_ERROR;
-        return ret;
+        return err;
+    }
+
+    *valid = fs_is_header(header_buf);
+    if (*valid)
+    {
+        fs_parse_header(header_buf, header);
+    }
+
+    return 0;
+}
+
+// Records never cross a sector boundary, `fs_write_packet()` leaves the tail
+// of a sector erased instead. Every used sector therefore starts with a
+// header, and going around the ring the part of that first header only
+// increases up to the sectors erased in front of the write position.
+static int fs_sector_used(struct device *d, uint32_t sector, fs_header_t *first, bool *used)
+{
+    fs_metrics.locate_end_reads++;
+    return fs_read_header(d, fs_sector_start(sector), first, used);
+}
+
+// Record counts are stored next to their complement, see flash.h
+static uint32_t fs_session_count(uint32_t count)
+{
+    if (count == FS_SESSION_COUNT_UNKNOWN)
+    {
+        return count;
+    }
+
+    return (count & 0xffff) | (~count & 0xffff) << 16;
+}
+
+void fs_session_pack(const fs_session_t *session, uint8_t *buf)
+{
+    fs_put_u32(buf, session->id);
+    fs_put_u32(buf + 4, session->start_time);
+    fs_put_u32(buf + FS_SESSION_COUNT_OFFSET, fs_session_count(session->record_count));
+    buf[12] = session->mode;
+    buf[13] = session->channel;
+    buf[14] = session->tx_power;
+    buf[15] = session->packet_size;
+}
+
+static void fs_session_unpack(const uint8_t *buf, fs_session_t *session)
+{
+    session->id = fs_get_u32(buf);
+    session->start_time = fs_get_u32(buf + 4);
+    uint32_t count = fs_get_u32(buf + FS_SESSION_COUNT_OFFSET);
+
+    // Unknown, or torn by a reset while being programmed otherwise
+    if ((count & 0xffff) == (~count >> 16))
+    {
+        session->record_count = count & 0xffff;
+    }
+    else
+    {
+        session->record_count = FS_SESSION_COUNT_UNKNOWN;
+    }
+
+    session->mode = buf[12];
+    session->channel = buf[13];
+    session->tx_power = buf[14];
+    session->packet_size = buf[15];
+}
+
+static off_t fs_dir_entry_offset(uint8_t sector, uint16_t i)
+{
+    return FS_DIR_OFFSET + (off_t)sector * FLASH_SECTOR_SIZE + i * FS_DIR_ENTRY_SIZE;
+}
+
+static uint16_t fs_dir_crc(const uint8_t *entry_buf)
+{
+    uint16_t crc = crc16_itu_t(FS_RECORD_CRC_SEED, entry_buf, 2);
+    return crc16_itu_t(crc, entry_buf + 4, FS_DIR_ENTRY_SIZE - 4);
+}
+
+// Reads entry `i` of directory sector `sector`. `*valid` is false if it is
+// unused or was torn by a reset, `*used` only if nothing was programmed.
+static int fs_dir_read_entry(struct device *d, uint8_t sector, uint16_t i,
+                             fs_dir_entry_t *entry, bool *valid, bool *used)
+{
+    uint8_t entry_buf[FS_DIR_ENTRY_SIZE];
+
+    int err = flash_read(d, fs_dir_entry_offset(sector, i), entry_buf, FS_DIR_ENTRY_SIZE);
+    if (err != 0)
+    {
+        return err;
+    }
+
+    *used = false;
+    for (uint8_t j = 0; j < FS_DIR_ENTRY_SIZE; j++)
+    {
+        *used |= entry_buf[j] != 0xff;
+    }
+
+    *valid = entry_buf[0] == FS_DIR_MAGIC && entry_buf[1] == FS_DIR_VERSION &&
+             (entry_buf[2] | entry_buf[3] << 8) == fs_dir_crc(entry_buf);
+    if (*valid)
+    {
+        entry->id = fs_get_u32(entry_buf + 4);
+        entry->offset = fs_get_u32(entry_buf + 8);
+        entry->part = fs_get_u32(entry_buf + 12);
     }
 
-    do
+    return 0;
+}
+
+static int fs_dir_read(struct device *d, uint8_t sector, uint16_t i,
+                       fs_dir_entry_t *entry, bool *valid)
+{
+    bool used;
+    return fs_dir_read_entry(d, sector, i, entry, valid, &used);
+}
+
+// Finds the directory sector entries are appended to, and bisects it for the
+// first unused entry. Session ids are consecutive within a sector, an entry
+// torn by a reset keeps its slot and id but is never listed.
+static int fs_dir_load(struct device *d)
+{
+    fs_dir_entry_t entry;
+    bool valid;
+    bool used;
+    int err;
+
+    fs_dir_sector = 0;
+    fs_dir_len = 0;
+    fs_next_session_id = 1;
+
+    for (uint8_t sector = 0; sector < FS_DIR_SECTORS; sector++)
     {
-        if (flash_read(d, offset, header_buf, 5) != 0)
+        err = fs_dir_read_entry(d, sector, 0, &entry, &valid, &used);
+        if (err != 0)
         {
-            ret.res = FS_ERROR;
-            return ret;
+            return err;
         }
 
-        // printk("fs_read: offset=%ld, %x %x %x %x %x\n", offset, header_buf[0], header_buf[1], header_buf[2], header_buf[3], header_buf[4]);
-
-        // If no packet here
-        if (header_buf[0] != 0xaa || header_buf[1] != 0xaa)
+        // Starting the sector was cut short, without its first id it lists
+        // nothing. Erase it, it is the next one to use anyway.
+        if (used && !valid)
         {
-            ret.res = FS_EOF;
-            return ret;
+            err = flash_erase(d, fs_dir_entry_offset(sector, 0), FLASH_SECTOR_SIZE);
+            if (err != 0)
+            {
+                return err;
+            }
+
+            fs_metrics.sectors_erased++;
         }
 
-        len = (uint16_t)header_buf[3] | ((uint16_t)header_buf[4]) << 8;
+        fs_dir_first_id[sector] = valid ? entry.id : 0;
+
+        if (fs_dir_first_id[sector] > fs_dir_first_id[fs_dir_sector])
+        {
+            fs_dir_sector = sector;
+        }
+    }
 
-        // header + len + first byte of next part
-        offset += round_to_pow2(len + 5);
+    if (fs_dir_first_id[fs_dir_sector] == 0)
+    {
+        return 0;
+    }
 
-    } while (header_buf[2] < part);
+    // Entry `lo` is used, entry `hi` is not (or past the end)
+    uint16_t lo = 0;
+    uint16_t hi = FS_DIR_ENTRIES;
 
-    if (flash_read(d, offset - round_to_pow2(len + 5), buf, len + 5) != 0)
+    while (hi - lo > 1)
     {
-        ret.res = FS_ERROR;
-        return ret;
+        uint16_t mid = lo + (hi - lo) / 2;
+
+        err = fs_dir_read_entry(d, fs_dir_sector, mid, &entry, &valid, &used);
+        if (err != 0)
+        {
+            return err;
+        }
+
+        if (used)
+        {
+            lo = mid;
+        }
+        else
+        {
+            hi = mid;
+        }
     }
 
-    ret.bytes_read = len + 5;
-    ret.res = FS_SUCCESS;
-    return ret;
+    fs_dir_len = lo + 1;
+    fs_next_session_id = fs_dir_first_id[fs_dir_sector] + fs_dir_len;
+    return 0;
 }
 
-void fs_reset()
+// Must hold `fs_mutex`
+static int fs_dir_append(struct device *d, uint32_t id, off_t offset, uint32_t part)
 {
-    fs_offset = 0;
+    int err;
+
+    if (fs_dir_len == FS_DIR_ENTRIES)
+    {
+        fs_dir_sector = (fs_dir_sector + 1) % FS_DIR_SECTORS;
+        fs_dir_len = 0;
+    }
+
+    // Starting a sector drops the sessions it listed. This happens once every
+    // `FS_DIR_ENTRIES` sessions, so it is erased right here.
+    if (fs_dir_len == 0)
+    {
+        fs_dir_first_id[fs_dir_sector] = 0;
+
+        err = flash_erase(d, fs_dir_entry_offset(fs_dir_sector, 0), FLASH_SECTOR_SIZE);
+        if (err != 0)
+        {
+            return err;
+        }
+
+        fs_metrics.sectors_erased++;
+    }
+
+    uint8_t entry_buf[FS_DIR_ENTRY_SIZE];
+
+    entry_buf[0] = FS_DIR_MAGIC;
+    entry_buf[1] = FS_DIR_VERSION;
+    fs_put_u32(entry_buf + 4, id);
+    fs_put_u32(entry_buf + 8, offset);
+    fs_put_u32(entry_buf + 12, part);
+
+    uint16_t crc = fs_dir_crc(entry_buf);
+
+    entry_buf[2] = crc & 0xff;
+    entry_buf[3] = (crc >> 8) & 0xff;
+
+    err = flash_write(d, fs_dir_entry_offset(fs_dir_sector, fs_dir_len), entry_buf,
+                      FS_DIR_ENTRY_SIZE);
+    if (err != 0)
+    {
+        return err;
+    }
+
+    if (fs_dir_len == 0)
+    {
+        fs_dir_first_id[fs_dir_sector] = id;
+    }
+
+    fs_dir_len++;
+    return 0;
 }
 
-int fs_skip_to_end(struct device *d)
+// Reads the session record a directory entry points at. `*valid` is false
+// if the log has wrapped around over it, or it never made it to flash.
+static int fs_dir_session(struct device *d, const fs_dir_entry_t *entry,
+                          fs_session_t *session, bool *valid)
 {
-    printk("fs_skip_to_end: start\n");
-    int err = 0;
+    uint8_t buf[FS_HEADER_SIZE + FS_SESSION_SIZE];
+    fs_header_t header;
 
-    if (reached_end)
+    *valid = false;
+
+    if (entry->offset >= FS_LOG_SIZE || entry->offset % 4 != 0)
     {
-        printk("fs_skip_to_end: reached end\n");
         return 0;
     }
 
-    if (!device_is_ready(d))
+    int err = flash_read(d, entry->offset, buf, sizeof(buf));
+    if (err != 0)
     {
-        return -1;
+        return err;
     }
 
-    uint16_t len = 0;
-    uint8_t header_buf[5];
+    if (!fs_is_header(buf))
+    {
+        return 0;
+    }
+
+    fs_parse_header(buf, &header);
+    fs_session_unpack(buf + FS_HEADER_SIZE, session);
+
+    *valid = header.type == FS_RECORD_SESSION && header.part == entry->part &&
+             header.len >= FS_SESSION_SIZE && session->id == entry->id;
+    return 0;
+}
+
+// Finds the session record of session `id` through the directory, and
+// returns the offset of the first record after it
+static int fs_dir_find(struct device *d, uint32_t id, off_t *start)
+{
+    fs_dir_entry_t entry;
+    fs_session_t session;
+    bool valid;
 
-    while (fs_offset < FLASH_SIZE - 6)
+    for (uint8_t sector = 0; sector < FS_DIR_SECTORS; sector++)
     {
-        printk("fs_skip_to_end: fs_offset=%u\n", fs_offset);
-        err = flash_read(d, fs_offset, header_buf, 5);
+        uint32_t first = fs_dir_first_id[sector];
+
+        // Session ids are consecutive within a directory sector
+        if (first == 0 || id < first || id - first >= FS_DIR_ENTRIES)
+        {
+            continue;
+        }
+
+        int err = fs_dir_read(d, sector, id - first, &entry, &valid);
+        if (err == 0 && valid)
+        {
+            err = fs_dir_session(d, &entry, &session, &valid);
+        }
         if (err != 0)
         {
             return err;
         }
 
-        // If no packet here
-        if (header_buf[0] != 0xaa || header_buf[1] != 0xaa)
+        if (valid && entry.id == id)
         {
-            // printk("reached end\n");
-            reached_end = true;
+            *start = (entry.offset + fs_record_size(FS_SESSION_SIZE)) % FS_LOG_SIZE;
             return 0;
         }
+    }
 
-        len = header_buf[3] | header_buf[4] << 8;
+    return -ENOENT;
+}
+
+// Writes out whatever is staged in `fs_page_buf`, must hold `fs_mutex`
+static int fs_flush_locked(struct device *d)
+{
+    if (fs_staged_offset == fs_offset)
+    {
+        return 0;
+    }
 
-        // header + len + first byte of next part
-        fs_offset += len + 5 + 1;
-        current_part = header_buf[2];
+    // Staged bytes never cross a page, and records keep them word aligned
+    uint16_t start = fs_staged_offset % FLASH_PAGE_SIZE;
+    uint16_t len = fs_offset - fs_staged_offset;
+
+    int err = flash_write(d, fs_staged_offset, fs_page_buf + start, len);
+    if (err != 0)
+    {
+        return err;
     }
 
-    // Should never happen ideally
-    return -1;
+    fs_metrics.flash_writes++;
+    fs_staged_offset = fs_offset;
+    return 0;
 }
 
-// Note that `len + 5` must be a power of 2
-// This is not checked, handle user side
-// Edit: Must be a factor of 4, see zephyr/drivers/flash/nrf_qspi_nor.c:qspi_nor_write()
-int fs_write_packet(struct device *d, uint8_t *buf, uint16_t len)
+// Walks back sector by sector from the write position to the start of the
+// latest session, and returns the offset of its first record
+static int fs_latest_session_start(struct device *d, off_t *start_offset)
 {
+    fs_header_t header;
+    bool valid;
     int err;
-    if (!reached_end)
+
+    // Sector holding the last record, the write position may be at its end
+    uint32_t sector = (fs_offset + FS_LOG_SIZE - 1) / FLASH_SECTOR_SIZE;
+    uint32_t newer_part = UINT32_MAX;
+    off_t start = -1;
+
+    for (uint32_t i = 0; i < FS_LOG_SECTORS && start < 0; i++)
     {
-        err = fs_skip_to_end(d);
+        off_t offset = fs_sector_start(sector);
+        off_t sector_end = offset + FLASH_SECTOR_SIZE;
 
+        err = fs_read_header(d, offset, &header, &valid);
         if (err != 0)
         {
             return err;
         }
+
+        // Went past the oldest sector, the log starts at the one after
+        if (!valid || header.part >= newer_part)
+        {
+            break;
+        }
+
+        newer_part = header.part;
+
+        while (valid)
+        {
+            offset += fs_record_size(header.len);
+
+            if (header.type == FS_RECORD_SESSION)
+            {
+                start = offset;
+            }
+
+            if (offset == fs_offset || offset + FS_HEADER_SIZE > sector_end)
+            {
+                break;
+            }
+
+            err = fs_read_header(d, offset, &header, &valid);
+            if (err != 0)
+            {
+                return err;
+            }
+        }
+
+        sector += FS_LOG_SECTORS - 1;
     }
 
-    uint16_t l = round_to_pow2(len + 5);
+    if (start < 0)
+    {
+        start = fs_sector_start(sector + 1);
+    }
 
-    printk("fs_write_packet: l %u len %u\n", l, len);
+    *start_offset = start % FS_LOG_SIZE;
+    return 0;
+}
 
-    uint8_t write_buf[l];
+// Indexes the data records of the selected session going forward from its
+// start, which the directory points at directly for a past session. Costs
+// about two header reads per record of that session, however much else is on
+// flash.
+static int fs_index_build(struct device *d)
+{
+    fs_header_t header;
+    bool valid;
+    int err;
 
-    write_buf[0] = 0xaa;
-    write_buf[1] = 0xaa;
-    write_buf[2] = current_part + 1;
-    write_buf[3] = (uint8_t)len & 0xff;
-    write_buf[4] = (uint8_t)(len >> 8) & 0xff;
+    fs_index_len = 0;
 
-    // printk("memcpy\n");
+    if (fs_selected_session == 0 && current_part == 0)
+    {
+        fs_index_built = true;
+        return 0;
+    }
 
-    memcpy(write_buf + 5, buf, len);
+    // Records are only read back from flash
+    err = fs_flush_locked(d);
+    if (err != 0)
+    {
+        return err;
+    }
 
-    printk("fs_write_packet: write offset=%u\n", fs_offset);
+    off_t offset;
 
-    err = flash_write(d, fs_offset, write_buf, l);
+    if (fs_selected_session != 0)
+    {
+        err = fs_dir_find(d, fs_selected_session, &offset);
+    }
+    else
+    {
+        err = fs_latest_session_start(d, &offset);
+    }
     if (err != 0)
     {
         return err;
     }
 
-    current_part++;
-    fs_offset += l;
+    while (offset != fs_offset)
+    {
+        err = fs_read_header(d, offset, &header, &valid);
+        if (err != 0)
+        {
+            return err;
+        }
+
+        // Erased tail of a sector, the log continues in the next one
+        if (!valid)
+        {
+            offset = ROUND_UP(offset + 1, FLASH_SECTOR_SIZE) % FS_LOG_SIZE;
+            continue;
+        }
+
+        // Start of the next session
+        if (header.type == FS_RECORD_SESSION)
+        {
+            break;
+        }
+
+        if (header.type == FS_RECORD_DATA)
+        {
+            // The rest is walked to by `fs_find_unindexed()`
+            if (fs_index_len == FS_INDEX_SIZE)
+            {
+                break;
+            }
+
+            fs_index_append(offset, header.len);
+        }
+
+        offset = (offset + fs_record_size(header.len)) % FS_LOG_SIZE;
+    }
 
+    fs_index_built = true;
     return 0;
-}
\ No newline at end of file
+}
+
+// Locates `part` of the selected session past the end of a full index, by
+// walking the headers on from the last indexed part. -ENOENT if the session
+// has fewer parts.
+static int fs_find_unindexed(struct device *d, uint32_t part, off_t *found, uint16_t *len)
+{
+    const fs_index_entry_t *last = &fs_index[FS_INDEX_SIZE - 1];
+    off_t offset = (last->offset + fs_record_size(last->len)) % FS_LOG_SIZE;
+    uint32_t n = FS_INDEX_SIZE;
+    fs_header_t header;
+    bool valid;
+
+    // Records are only read back from flash
+    int err = fs_flush_locked(d);
+    if (err != 0)
+    {
+        return err;
+    }
+
+    while (offset != fs_offset)
+    {
+        err = fs_read_header(d, offset, &header, &valid);
+        if (err != 0)
+        {
+            return err;
+        }
+
+        if (!valid)
+        {
+            offset = ROUND_UP(offset + 1, FLASH_SECTOR_SIZE) % FS_LOG_SIZE;
+            continue;
+        }
+
+        if (header.type == FS_RECORD_SESSION)
+        {
+            break;
+        }
+
+        if (header.type == FS_RECORD_DATA && ++n == part)
+        {
+            *found = offset;
+            *len = header.len;
+            return 0;
+        }
+
+        offset = (offset + fs_record_size(header.len)) % FS_LOG_SIZE;
+    }
+
+    return -ENOENT;
+}
+
+// Erases sector `fs_erased_sectors`. Must hold `fs_mutex`, which is released
+// for the duration of the erase so writes to already erased sectors go on.
+static int fs_erase_next_locked(struct device *d)
+{
+    uint32_t sector = fs_erased_sectors;
+
+    fs_erasing = true;
+    k_mutex_unlock(&fs_mutex);
+
+    int err = flash_erase(d, fs_sector_start(sector), FLASH_SECTOR_SIZE);
+
+    k_mutex_lock(&fs_mutex, K_FOREVER);
+    fs_erasing = false;
+
+    if (err == 0)
+    {
+        fs_erased_sectors = sector + 1;
+        fs_metrics.sectors_erased++;
+    }
+
+    k_condvar_broadcast(&fs_erased_cond);
+    return err;
+}
+
+// Keeps `FS_ERASE_AHEAD` sectors in front of the write position erased, so
+// writers normally never wait for an erase
+static void fs_erase_thread(void)
+{
+    while (true)
+    {
+        k_sem_take(&fs_erase_sem, K_FOREVER);
+
+        k_mutex_lock(&fs_mutex, K_FOREVER);
+
+        while (reached_end && !fs_erasing &&
+               fs_erased_sectors <= fs_head_sector + FS_ERASE_AHEAD)
+        {
+            int err = fs_erase_next_locked(fs_flash_device);
+            if (err != 0)
+            {
+                printk("fs_erase_thread: flash_erase err=%d\n", err);
+                break;
+            }
+        }
+
+        k_mutex_unlock(&fs_mutex);
+    }
+}
+
+int fs_erase(struct device *d)
+{
+    k_mutex_lock(&fs_mutex, K_FOREVER);
+
+    while (fs_erasing)
+    {
+        k_condvar_wait(&fs_erased_cond, &fs_mutex, K_FOREVER);
+    }
+
+    // Takes the session directory with it
+    int err = flash_erase(d, 0, FLASH_SIZE);
+    if (err == 0)
+    {
+        fs_offset = 0;
+        fs_staged_offset = 0;
+        current_part = 0;
+        fs_head_sector = 0;
+        fs_erased_sectors = FS_LOG_SECTORS;
+        fs_index_len = 0;
+        fs_index_built = true;
+        fs_selected_session = 0;
+        fs_session_offset = -1;
+        fs_dir_sector = 0;
+        fs_dir_len = 0;
+        memset(fs_dir_first_id, 0, sizeof(fs_dir_first_id));
+        fs_next_session_id = 1;
+        reached_end = true;
+    }
+
+    k_mutex_unlock(&fs_mutex);
+    return err;
+}
+
+void fs_init(void)
+{
+    printk("fs_init: Getting QSPI flash\n");
+    if (fs_flash_device == NULL)
+    {
+        fs_flash_device = DEVICE_DT_GET(DT_ALIAS(spi_flash0));
+        while (!device_is_ready(fs_flash_device))
+        {
+        }
+    }
+
+    // Locate the end of the log once, so the first write doesn't have to
+    if (fs_skip_to_end(fs_flash_device) != 0)
+    {
+        printk("fs_init: could not find end of log\n");
+        return;
+    }
+
+    printk("fs_init: end of log at %u, found in %u us with %u reads, %u torn records\n",
+           (uint32_t)fs_offset, fs_metrics.locate_end_us, fs_metrics.locate_end_reads,
+           fs_metrics.torn_records);
+
+    // Start erasing ahead of the write position
+    k_sem_give(&fs_erase_sem);
+}
+
+flash_read_t fs_read(struct device *d,
+                     uint8_t *buf,
+                     uint32_t part)
+{
+    flash_read_t ret;
+
+    if (!device_is_ready(d))
+    {
+        ret.res = FS_ERROR;
+        return ret;
+    }
+
+    k_mutex_lock(&fs_mutex, K_FOREVER);
+
+    if (!fs_index_built && fs_index_build(d) != 0)
+    {
+        ret.res = FS_ERROR;
+        goto unlock;
+    }
+
+    off_t offset;
+    uint16_t len;
+
+    if (part == 0 || (part > fs_index_len && fs_index_len < FS_INDEX_SIZE))
+    {
+        ret.res = FS_EOF;
+        goto unlock;
+    }
+
+    if (part <= fs_index_len)
+    {
+        offset = fs_index[part - 1].offset;
+        len = fs_index[part - 1].len;
+
+        // Parts still sitting in the staging buffer are not readable until
+        // flushed
+        if (offset < fs_offset && offset + FS_HEADER_SIZE + len > fs_staged_offset)
+        {
+            ret.res = FS_EOF;
+            goto unlock;
+        }
+    }
+    else
+    {
+        int err = fs_find_unindexed(d, part, &offset, &len);
+        if (err != 0)
+        {
+            ret.res = err == -ENOENT ? FS_EOF : FS_ERROR;
+            goto unlock;
+        }
+    }
+
+    // Padding is not part of the record
+    if (flash_read(d, offset, buf, FS_HEADER_SIZE + len) != 0)
+    {
+        ret.res = FS_ERROR;
+        goto unlock;
+    }
+
+    ret.bytes_read = FS_HEADER_SIZE + len;
+    ret.res = FS_SUCCESS;
+
+unlock:
+    k_mutex_unlock(&fs_mutex);
+    return ret;
+}
+
+// Checks the CRC and commit marker of the record at `offset`. Nothing is
+// staged before the end of the log is found, so `fs_page_buf` is free to read
+// into.
+static int fs_check_record(struct device *d, off_t offset, const fs_header_t *header, bool *valid)
+{
+    uint16_t crc_len = FS_HEADER_SIZE + header->len;
+    uint16_t size = fs_record_size(header->len);
+    uint16_t crc = FS_RECORD_CRC_SEED;
+    uint16_t pos = 0;
+    uint16_t n = 0;
+
+    // Session record counts are programmed after the CRC, which covers them
+    // still erased
+    uint16_t count_pos = FS_HEADER_SIZE + FS_SESSION_COUNT_OFFSET;
+    bool mask_count = header->type == FS_RECORD_SESSION && header->len >= FS_SESSION_SIZE;
+
+    while (true)
+    {
+        n = MIN(size - pos, FLASH_PAGE_SIZE);
+
+        int err = flash_read(d, offset + pos, fs_page_buf, n);
+        if (err != 0)
+        {
+            return err;
+        }
+
+        fs_metrics.locate_end_reads++;
+
+        for (uint16_t i = 0; mask_count && i < n; i++)
+        {
+            if (pos + i >= count_pos && pos + i < count_pos + 4)
+            {
+                fs_page_buf[i] = 0xff;
+            }
+        }
+
+        if (pos < crc_len)
+        {
+            crc = crc16_itu_t(crc, fs_page_buf, MIN(n, crc_len - pos));
+        }
+
+        if (pos + n == size)
+        {
+            break;
+        }
+
+        pos += n;
+    }
+
+    // Records are word aligned, so the trailer is never split over two reads
+    const uint8_t *trailer = fs_page_buf + n - FS_TRAILER_SIZE;
+
+    *valid = (trailer[0] | trailer[1] << 8) == crc &&
+             (trailer[2] | trailer[3] << 8) == FS_RECORD_COMMIT;
+    return 0;
+}
+
+// Checks that nothing was programmed from `offset` to the end of its page.
+// Records are programmed at most a page at a time, so that is as far as a
+// write torn before its first header could have got.
+static int fs_check_erased(struct device *d, off_t offset, bool *erased)
+{
+    uint16_t n = ROUND_UP(offset + 1, FLASH_PAGE_SIZE) - offset;
+
+    int err = flash_read(d, offset, fs_page_buf, n);
+    if (err != 0)
+    {
+        return err;
+    }
+
+    fs_metrics.locate_end_reads++;
+
+    *erased = true;
+    for (uint16_t i = 0; i < n; i++)
+    {
+        *erased &= fs_page_buf[i] == 0xff;
+    }
+
+    return 0;
+}
+
+// Walks the records of `sector`, setting `current_part` to the last one and
+// `*end` to where it ends. With `check`, records are checked for a write
+// torn by a reset; a torn record is sealed and `*torn` set, with `*end` where
+// it starts.
+static int fs_walk_sector(struct device *d, uint32_t sector, bool check, off_t *end, bool *torn)
+{
+    off_t offset = fs_sector_start(sector);
+    off_t sector_end = offset + FLASH_SECTOR_SIZE;
+    fs_header_t header;
+    bool valid = false;
+    int err;
+
+    *torn = false;
+
+    while (offset + FS_HEADER_SIZE <= sector_end)
+    {
+        err = fs_read_header(d, offset, &header, &valid);
+        if (err != 0)
+        {
+            return err;
+        }
+
+        fs_metrics.locate_end_reads++;
+
+        if (valid && check)
+        {
+            bool intact = offset + fs_record_size(header.len) <= sector_end;
+
+            if (intact)
+            {
+                err = fs_check_record(d, offset, &header, &intact);
+                if (err != 0)
+                {
+                    return err;
+                }
+            }
+
+            *torn = !intact;
+            valid = intact;
+        }
+
+        if (!valid)
+        {
+            break;
+        }
+
+        offset += fs_record_size(header.len);
+        current_part = header.part;
+    }
+
+    *end = MIN(offset, sector_end);
+
+    if (!check || *end == sector_end)
+    {
+        return 0;
+    }
+
+    if (!*torn)
+    {
+        bool erased;
+
+        err = fs_check_erased(d, *end, &erased);
+        if (err != 0)
+        {
+            return err;
+        }
+
+        *torn = !erased;
+    }
+
+    if (*torn)
+    {
+        // Readers take a record without the magic for the erased tail of the
+        // sector. Programming can only clear bits, so this always sticks.
+        uint8_t seal[4] = {0};
+
+        printk("fs_walk_sector: sealing torn record at %u\n", (uint32_t)*end);
+        return flash_write(d, *end, seal, sizeof(seal));
+    }
+
+    return 0;
+}
+
+// Bisects around the ring for the sector holding the highest part, then walks
+// the headers of that single sector, checking its records for one torn by a
+// reset. Costs O(log n) reads regardless of the log size.
+static int fs_skip_to_end_locked(struct device *d)
+{
+    printk("fs_skip_to_end: start\n");
+    int err = 0;
+
+    if (reached_end)
+    {
+        printk("fs_skip_to_end: reached end\n");
+        return 0;
+    }
+
+    if (!device_is_ready(d))
+    {
+        return -1;
+    }
+
+    uint32_t start = k_cycle_get_32();
+    fs_metrics.locate_end_reads = 0;
+
+    fs_offset = 0;
+    current_part = 0;
+    fs_index_len = 0;
+    fs_index_built = false;
+    fs_session_offset = -1;
+
+    err = fs_dir_load(d);
+    if (err != 0)
+    {
+        return err;
+    }
+
+    // Until the log first wraps around it starts at sector 0, after that at
+    // most `FS_ERASE_AHEAD` sectors in a row are unused
+    fs_header_t first;
+    bool used = false;
+    uint32_t ref = 0;
+
+    while (ref <= FS_ERASE_AHEAD + 1)
+    {
+        err = fs_sector_used(d, ref, &first, &used);
+        if (err != 0)
+        {
+            return err;
+        }
+
+        if (used)
+        {
+            break;
+        }
+
+        ref++;
+    }
+
+    if (used)
+    {
+        // Invariant, counting sectors from `ref`: sector `lo` is used and not
+        // older than `ref`, sector `hi` is not (or all the way around)
+        uint32_t lo = 0;
+        uint32_t hi = FS_LOG_SECTORS;
+
+        while (hi - lo > 1)
+        {
+            uint32_t mid = lo + (hi - lo) / 2;
+            fs_header_t header;
+
+            err = fs_sector_used(d, ref + mid, &header, &used);
+            if (err != 0)
+            {
+                return err;
+            }
+
+            if (used && header.part >= first.part)
+            {
+                lo = mid;
+            }
+            else
+            {
+                hi = mid;
+            }
+        }
+
+        uint32_t sector = ref + lo;
+        off_t sector_end = fs_sector_start(sector) + FLASH_SECTOR_SIZE;
+        off_t offset;
+        bool torn;
+
+        err = fs_walk_sector(d, sector, true, &offset, &torn);
+        if (err != 0)
+        {
+            return err;
+        }
+
+        if (!torn)
+        {
+            fs_offset = offset % FS_LOG_SIZE;
+        }
+        else if (offset == fs_sector_start(sector))
+        {
+            // Nothing in the sector made it, it is erased and written again.
+            // Parts carry on from the sector before.
+            err = fs_walk_sector(d, sector + FS_LOG_SECTORS - 1, false, &offset, &torn);
+            if (err != 0)
+            {
+                return err;
+            }
+
+            fs_offset = fs_sector_start(sector);
+            fs_metrics.torn_records++;
+        }
+        else
+        {
+            // The rest of the sector can't be programmed anymore, and readers
+            // go on to the next sector at the sealed record
+            fs_offset = sector_end % FS_LOG_SIZE;
+            fs_metrics.torn_records++;
+        }
+    }
+
+    fs_staged_offset = fs_offset;
+
+    // The sector at the write position is only known to be erased if
+    // something has been written to it already
+    fs_head_sector = fs_offset / FLASH_SECTOR_SIZE;
+    fs_erased_sectors = fs_head_sector + (fs_offset % FLASH_SECTOR_SIZE != 0);
+
+    fs_metrics.locate_end_us = k_cyc_to_us_floor32(k_cycle_get_32() - start);
+    reached_end = true;
+    return 0;
+}
+
+int fs_skip_to_end(struct device *d)
+{
+    k_mutex_lock(&fs_mutex, K_FOREVER);
+    int err = fs_skip_to_end_locked(d);
+    k_mutex_unlock(&fs_mutex);
+
+    return err;
+}
+
+// Appends to the staging buffer, programming each page once it is full
+static int fs_stage(struct device *d, const uint8_t *buf, uint16_t len, bool erased)
+{
+    while (len > 0)
+    {
+        uint16_t pos = fs_offset % FLASH_PAGE_SIZE;
+        uint16_t chunk = MIN(len, FLASH_PAGE_SIZE - pos);
+
+        if (erased)
+        {
+            memset(fs_page_buf + pos, 0xff, chunk);
+        }
+        else
+        {
+            memcpy(fs_page_buf + pos, buf, chunk);
+            buf += chunk;
+        }
+
+        fs_offset += chunk;
+        len -= chunk;
+
+        if (fs_offset % FLASH_PAGE_SIZE == 0)
+        {
+            int err = fs_flush_locked(d);
+            if (err != 0)
+            {
+                return err;
+            }
+
+            if (fs_offset == FS_LOG_SIZE)
+            {
+                fs_offset = 0;
+                fs_staged_offset = 0;
+            }
+        }
+    }
+
+    return 0;
+}
+
+int fs_flush(struct device *d)
+{
+    k_mutex_lock(&fs_mutex, K_FOREVER);
+    int err = fs_flush_locked(d);
+    k_mutex_unlock(&fs_mutex);
+
+    return err;
+}
+
+// Must hold `fs_mutex`
+static int fs_write_record_locked(struct device *d, fs_record_type_t type,
+                                  const uint8_t *buf, uint16_t len, off_t *record_offset)
+{
+    int err;
+
+    if (!reached_end)
+    {
+        err = fs_skip_to_end_locked(d);
+
+        if (err != 0)
+        {
+            return err;
+        }
+    }
+
+    uint16_t l = fs_record_size(len);
+
+    if (l > FLASH_SECTOR_SIZE)
+    {
+        return -EINVAL;
+    }
+
+    while (true)
+    {
+        // Don't let the record straddle a sector, see `fs_sector_used()`
+        if (fs_offset % FLASH_SECTOR_SIZE + l > FLASH_SECTOR_SIZE)
+        {
+            err = fs_flush_locked(d);
+            if (err != 0)
+            {
+                return err;
+            }
+
+            fs_offset = ROUND_UP(fs_offset, FLASH_SECTOR_SIZE) % FS_LOG_SIZE;
+            fs_staged_offset = fs_offset;
+        }
+
+        if (fs_offset / FLASH_SECTOR_SIZE != fs_head_sector % FS_LOG_SECTORS)
+        {
+            fs_head_sector++;
+            k_sem_give(&fs_erase_sem);
+        }
+
+        if (fs_erased_sectors > fs_head_sector)
+        {
+            break;
+        }
+
+        // Caught up with the erasing, wait for it or erase the sector here.
+        // Other writers may get in meanwhile, so place the record again.
+        fs_metrics.erase_waits++;
+
+        if (fs_erasing)
+        {
+            k_condvar_wait(&fs_erased_cond, &fs_mutex, K_FOREVER);
+        }
+        else
+        {
+            err = fs_erase_next_locked(d);
+            if (err != 0)
+            {
+                return err;
+            }
+        }
+    }
+
+    off_t offset = fs_offset;
+    uint32_t part = current_part + 1;
+    uint16_t len_type = len | type << FS_RECORD_TYPE_SHIFT;
+    uint8_t header_buf[FS_HEADER_SIZE];
+
+    header_buf[0] = FS_RECORD_MAGIC;
+    header_buf[1] = FS_RECORD_VERSION;
+    header_buf[2] = len_type & 0xff;
+    header_buf[3] = (len_type >> 8) & 0xff;
+    header_buf[4] = part & 0xff;
+    header_buf[5] = (part >> 8) & 0xff;
+    header_buf[6] = (part >> 16) & 0xff;
+    header_buf[7] = (part >> 24) & 0xff;
+
+    uint16_t crc = crc16_itu_t(FS_RECORD_CRC_SEED, header_buf, FS_HEADER_SIZE);
+    crc = crc16_itu_t(crc, buf, len);
+
+    uint8_t trailer_buf[FS_TRAILER_SIZE];
+
+    trailer_buf[0] = crc & 0xff;
+    trailer_buf[1] = (crc >> 8) & 0xff;
+    trailer_buf[2] = FS_RECORD_COMMIT & 0xff;
+    trailer_buf[3] = (FS_RECORD_COMMIT >> 8) & 0xff;
+
+    err = fs_stage(d, header_buf, FS_HEADER_SIZE, false);
+    if (err == 0)
+    {
+        err = fs_stage(d, buf, len, false);
+    }
+    if (err == 0)
+    {
+        // Padding is left erased
+        err = fs_stage(d, NULL, l - FS_HEADER_SIZE - len - FS_TRAILER_SIZE, true);
+    }
+    if (err == 0)
+    {
+        err = fs_stage(d, trailer_buf, FS_TRAILER_SIZE, false);
+    }
+    if (err != 0)
+    {
+        return err;
+    }
+
+    if (type == FS_RECORD_DATA && fs_index_built && fs_selected_session == 0)
+    {
+        fs_index_append(offset, len);
+    }
+    if (type == FS_RECORD_DATA)
+    {
+        fs_session_records++;
+    }
+
+    if (record_offset != NULL)
+    {
+        *record_offset = offset;
+    }
+
+    current_part++;
+    return 0;
+}
+
+int fs_session_start(struct device *d, fs_session_t *session)
+{
+    uint8_t buf[FS_SESSION_SIZE];
+    off_t offset;
+
+    k_mutex_lock(&fs_mutex, K_FOREVER);
+
+    session->id = fs_next_session_id;
+    session->start_time = k_uptime_get_32();
+    session->record_count = FS_SESSION_COUNT_UNKNOWN;
+    fs_session_pack(session, buf);
+
+    int err = fs_write_record_locked(d, FS_RECORD_SESSION, buf, FS_SESSION_SIZE, &offset);
+    if (err == 0)
+    {
+        // Reads follow the new session
+        fs_selected_session = 0;
+        fs_index_len = 0;
+        fs_index_built = true;
+
+        fs_session_offset = offset;
+        fs_session_records = 0;
+
+        err = fs_dir_append(d, session->id, offset, current_part);
+    }
+    if (err == 0)
+    {
+        fs_next_session_id++;
+    }
+
+    k_mutex_unlock(&fs_mutex);
+    return err;
+}
+
+// Flushes the log and programs the record count into the session record,
+// which was left erased for it
+int fs_session_end(struct device *d)
+{
+    int err = 0;
+
+    k_mutex_lock(&fs_mutex, K_FOREVER);
+
+    if (fs_session_offset >= 0)
+    {
+        err = fs_flush_locked(d);
+    }
+    if (fs_session_offset >= 0 && err == 0)
+    {
+        uint8_t count_buf[4];
+
+        fs_put_u32(count_buf, fs_session_count(fs_session_records));
+        err = flash_write(d, fs_session_offset + FS_HEADER_SIZE + FS_SESSION_COUNT_OFFSET,
+                          count_buf, sizeof(count_buf));
+        fs_session_offset = -1;
+    }
+
+    k_mutex_unlock(&fs_mutex);
+    return err;
+}
+
+int fs_session_list(struct device *d, fs_session_t *sessions, uint16_t max)
+{
+    fs_dir_entry_t entry;
+    bool valid;
+    int n = 0;
+
+    k_mutex_lock(&fs_mutex, K_FOREVER);
+
+    // The running session's record may still be staged
+    int err = fs_flush_locked(d);
+
+    // Newest first, from the last entry back through the directory sectors
+    uint8_t sector = fs_dir_sector;
+    int32_t i = fs_dir_len - 1;
+
+    for (uint8_t s = 0; s < FS_DIR_SECTORS && err == 0 && n < max; s++)
+    {
+        if (fs_dir_first_id[sector] == 0)
+        {
+            break;
+        }
+
+        for (; i >= 0 && n < max; i--)
+        {
+            err = fs_dir_read(d, sector, i, &entry, &valid);
+            if (err == 0 && valid)
+            {
+                err = fs_dir_session(d, &entry, &sessions[n], &valid);
+            }
+            if (err != 0)
+            {
+                break;
+            }
+
+            // Entries whose session record is gone are skipped, not the end
+            // of the list: the record may just not have been flushed before
+            // a reset
+            if (valid)
+            {
+                n++;
+            }
+        }
+
+        sector = (sector + FS_DIR_SECTORS - 1) % FS_DIR_SECTORS;
+        i = FS_DIR_ENTRIES - 1;
+    }
+
+    k_mutex_unlock(&fs_mutex);
+    return err != 0 ? err : n;
+}
+
+int fs_session_select(struct device *d, uint32_t id)
+{
+    ARG_UNUSED(d);
+
+    k_mutex_lock(&fs_mutex, K_FOREVER);
+
+    // The latest session is followed as it grows
+    if (id == fs_next_session_id - 1)
+    {
+        id = 0;
+    }
+
+    if (id != fs_selected_session)
+    {
+        fs_selected_session = id;
+        fs_index_built = false;
+    }
+
+    k_mutex_unlock(&fs_mutex);
+    return 0;
+}
+
+// Costs no flash reads for the latest session, and a directory lookup for a
+// past one
+int fs_cursor_open(struct device *d, fs_cursor_t *cursor)
+{
+    off_t start;
+    int err;
+
+    k_mutex_lock(&fs_mutex, K_FOREVER);
+
+    // Streamed records are only read back from flash
+    err = fs_flush_locked(d);
+    if (err != 0)
+    {
+        goto unlock;
+    }
+
+    if (fs_selected_session != 0)
+    {
+        err = fs_dir_find(d, fs_selected_session, &start);
+    }
+    else if (current_part == 0)
+    {
+        start = fs_offset;
+    }
+    else
+    {
+        err = fs_latest_session_start(d, &start);
+    }
+
+    if (err == 0)
+    {
+        cursor->offset = start;
+        cursor->record = start;
+        cursor->end = fs_offset;
+    }
+
+unlock:
+    k_mutex_unlock(&fs_mutex);
+    return err;
+}
+
+// Reads straight into `buf`, then walks the headers that landed in it to cut
+// the chunk short at a sector tail or the next session. Every byte of the
+// session is read from flash once.
+int fs_cursor_next_chunk(struct device *d, fs_cursor_t *cursor, uint8_t *buf, uint16_t max)
+{
+    int err = 0;
+    uint16_t n = 0;
+
+    if (max < FS_HEADER_SIZE)
+    {
+        return -EINVAL;
+    }
+
+    k_mutex_lock(&fs_mutex, K_FOREVER);
+
+    while (n == 0 && cursor->offset != cursor->end)
+    {
+        off_t offset = cursor->offset;
+        off_t sector_end = ROUND_UP(offset + 1, FLASH_SECTOR_SIZE);
+        off_t left = (cursor->end + FS_LOG_SIZE - offset) % FS_LOG_SIZE;
+
+        // Records never cross a sector, and neither do chunks
+        n = MIN(MIN((off_t)max, sector_end - offset), left);
+
+        err = flash_read(d, offset, buf, n);
+        if (err != 0)
+        {
+            n = 0;
+            break;
+        }
+
+        off_t next = offset + n;
+
+        while (cursor->record < offset + n)
+        {
+            uint16_t pos = cursor->record - offset;
+            fs_header_t header;
+
+            // Erased tail of a sector, the session continues in the next one
+            if (buf[pos] != FS_RECORD_MAGIC)
+            {
+                n = pos;
+                next = sector_end;
+                cursor->record = sector_end;
+                break;
+            }
+
+            // Send the header with its record in the next chunk, so it can
+            // be checked for the start of the next session first
+            if (pos + FS_HEADER_SIZE > n)
+            {
+                // Headers never cross a sector or the end of the session
+                if (pos == 0)
+                {
+                    err = -EIO;
+                    break;
+                }
+
+                n = pos;
+                next = cursor->record;
+                break;
+            }
+
+            if (!fs_is_header(buf + pos))
+            {
+                err = -EIO;
+                break;
+            }
+
+            fs_parse_header(buf + pos, &header);
+
+            if (header.type == FS_RECORD_SESSION)
+            {
+                n = pos;
+                next = cursor->record;
+                cursor->end = cursor->record;
+                break;
+            }
+
+            cursor->record += fs_record_size(header.len);
+        }
+
+        if (err != 0)
+        {
+            n = 0;
+            break;
+        }
+
+        cursor->offset = next % FS_LOG_SIZE;
+        cursor->record %= FS_LOG_SIZE;
+    }
+
+    k_mutex_unlock(&fs_mutex);
+    return err != 0 ? err : n;
+}
+
+void fs_cursor_close(fs_cursor_t *cursor)
+{
+    cursor->offset = cursor->end;
+    cursor->record = cursor->end;
+}
+
+// Records are staged in RAM and only reach the flash a page at a time, call
+// `fs_flush()` to write out a partial page.
+int fs_write_packet(struct device *d, uint8_t *buf, uint16_t len)
+{
+    return fs_write_record(d, FS_RECORD_DATA, buf, len);
+}
+
+int fs_write_record(struct device *d, fs_record_type_t type, uint8_t *buf, uint16_t len)
+{
+    int err;
+
+    k_mutex_lock(&fs_mutex, K_FOREVER);
+
+    err = fs_write_record_locked(d, type, buf, len, NULL);
+
+    k_mutex_unlock(&fs_mutex);
+    return err;
+}
+
+K_THREAD_DEFINE(fs_erase_thread_id, FS_ERASE_THREAD_STACKSIZE, fs_erase_thread, NULL, NULL, NULL,
+                FS_ERASE_THREAD_PRIORITY, 0, 0);
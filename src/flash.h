@@ -3,11 +3,98 @@
 
 #include <stdbool.h>
 #include <stdint.h>
+#include <sys/types.h>
 
 #include <zephyr/device.h>
 
 #define FLASH_SIZE 16777216
-#define FLASH_SECTOR_SIZE 4069
+#define FLASH_SECTOR_SIZE 4096
+#define FLASH_PAGE_SIZE 256
+
+// The session directory takes the last sectors of the flash, the log is a
+// ring over the rest
+#define FS_DIR_SECTORS 2
+#define FS_LOG_SECTORS (FLASH_SIZE / FLASH_SECTOR_SIZE - FS_DIR_SECTORS)
+#define FS_LOG_SIZE (FS_LOG_SECTORS * FLASH_SECTOR_SIZE)
+#define FS_DIR_OFFSET FS_LOG_SIZE
+
+// Number of sectors kept erased in front of the write position
+#define FS_ERASE_AHEAD 8
+
+// Log record layout, multi-byte fields are little endian:
+//   0  FS_RECORD_MAGIC
+//   1  FS_RECORD_VERSION
+//   2  payload length (low 12 bits) and record type (high 4 bits), 2 bytes
+//   4  part, 4 bytes, counting up from 1 across all sessions
+//   8  payload, padded with 0xff to a multiple of 4
+// followed by a trailer:
+//   0  CRC-16/CCITT-FALSE of header and payload, 2 bytes
+//   2  FS_RECORD_COMMIT, 2 bytes
+// The trailer is programmed last, a record cut short by a reset has no
+// commit marker or a bad CRC.
+#define FS_RECORD_MAGIC 0xaa
+#define FS_RECORD_VERSION 0x04
+#define FS_HEADER_SIZE 8
+#define FS_TRAILER_SIZE 4
+#define FS_RECORD_CRC_SEED 0xffff
+#define FS_RECORD_COMMIT 0x3cc3
+#define FS_RECORD_LEN_MASK 0x0fff
+#define FS_RECORD_TYPE_SHIFT 12
+
+typedef enum
+{
+    // RX statistics snapshot
+    FS_RECORD_DATA = 0x0,
+
+    // Start of a session, every record after it belongs to that session.
+    // Carries an `FS_SESSION_SIZE` payload, see below.
+    FS_RECORD_SESSION = 0x1,
+
+    // Batch of per-packet RX events, the payload format is the radio's
+    FS_RECORD_RX_EVENTS = 0x2,
+} fs_record_type_t;
+
+// Session record payload, also how sessions are listed to the host:
+//   0  session id, 4 bytes, counting up from 1
+//   4  start time, 4 bytes, ms since boot
+//   8  number of data records, 2 bytes, then its complement, 2 bytes. All
+//      0xff (FS_SESSION_COUNT_UNKNOWN) until `fs_session_end()` programs it,
+//      a count torn by a reset reads back as unknown.
+//   12 radio mode, channel, tx power and packet size, 1 byte each
+#define FS_SESSION_SIZE 16
+#define FS_SESSION_COUNT_UNKNOWN 0xffffffff
+
+// Session directory entry, one per session in the order they started:
+//   0  FS_DIR_MAGIC
+//   1  FS_DIR_VERSION
+//   2  CRC-16/CCITT-FALSE of the rest of the entry, 2 bytes
+//   4  session id, 4 bytes
+//   8  offset of the session record, 4 bytes
+//   12 part of the session record, 4 bytes
+// Entries fill one directory sector, then the other is erased and filled,
+// so between one and two sectors worth of sessions are listed.
+#define FS_DIR_MAGIC 0xd5
+#define FS_DIR_VERSION 0x02
+#define FS_DIR_ENTRY_SIZE 16
+#define FS_DIR_ENTRIES (FLASH_SECTOR_SIZE / FS_DIR_ENTRY_SIZE)
+
+typedef struct
+{
+    uint32_t id;
+    uint32_t start_time;
+    uint32_t record_count;
+    uint8_t mode;
+    uint8_t channel;
+    uint8_t tx_power;
+    uint8_t packet_size;
+} fs_session_t;
+
+// Writes `session` out in the layout above, `FS_SESSION_SIZE` bytes
+void fs_session_pack(const fs_session_t *session, uint8_t *buf);
+
+// Parts of a session `fs_read()` locates through the RAM index, it walks the
+// headers to the ones after
+#define FS_INDEX_SIZE 1024
 
 extern struct device *fs_flash_device;
 
@@ -19,6 +106,29 @@ typedef enum
     FS_EOF = 0x01,
 } flash_read_result_t;
 
+typedef struct
+{
+    // Time `fs_skip_to_end()` took to locate the end of the log at boot
+    uint32_t locate_end_us;
+
+    // Number of flash reads it needed for that
+    uint16_t locate_end_reads;
+
+    // Number of flash writes, at most one per page written to
+    uint32_t flash_writes;
+
+    // Number of sectors erased
+    uint32_t sectors_erased;
+
+    // Number of times a write had to wait for a sector to be erased
+    uint32_t erase_waits;
+
+    // Number of records found torn by a reset at boot
+    uint32_t torn_records;
+} fs_metrics_t;
+
+extern fs_metrics_t fs_metrics;
+
 typedef struct
 {
     uint16_t bytes_read;
@@ -27,15 +137,58 @@ typedef struct
 
 flash_read_t fs_read(struct device *d,
                      uint8_t *buf,
-                     uint8_t part);
+                     uint32_t part);
 
 int fs_skip_to_end(struct device *d);
 
 int fs_write_packet(struct device *d, uint8_t *buf, uint16_t len);
 
-int fs_erase(struct device *d, uint8_t sectors);
+// Appends a record of any type. Only data records are indexed for
+// `fs_read()`, the cursor returns all of them.
+int fs_write_record(struct device *d, fs_record_type_t type, uint8_t *buf, uint16_t len);
+
+// Fills in `session->id` and `session->start_time`, the radio settings are
+// the caller's
+int fs_session_start(struct device *d, fs_session_t *session);
+
+int fs_session_end(struct device *d);
+
+// Lists up to `max` sessions still on flash, newest first. Returns how many
+// or a negative error.
+int fs_session_list(struct device *d, fs_session_t *sessions, uint16_t max);
+
+// Makes `fs_read()` and cursors return the parts of session `id`, 0 for the
+// latest one
+int fs_session_select(struct device *d, uint32_t id);
+
+// Forward cursor over the data and RX_EVENTS records of the selected
+// session. Streams them as they are on flash: each record's header, payload
+// padded to a multiple of 4, and trailer. Sector tails and the session
+// record are skipped.
+typedef struct
+{
+    // Next byte to stream
+    off_t offset;
+
+    // Next record header, at or after `offset`
+    off_t record;
+
+    // End of the session
+    off_t end;
+} fs_cursor_t;
+
+int fs_cursor_open(struct device *d, fs_cursor_t *cursor);
+
+// Reads the next at most `max` bytes of the session into `buf`, which must
+// hold at least `FS_HEADER_SIZE`. Returns how many, 0 at the end of the
+// session or a negative error.
+int fs_cursor_next_chunk(struct device *d, fs_cursor_t *cursor, uint8_t *buf, uint16_t max);
+
+void fs_cursor_close(fs_cursor_t *cursor);
+
+int fs_flush(struct device *d);
 
-void fs_reset(void);
+int fs_erase(struct device *d);
 
 void fs_init(void);
 
@@ -6,6 +6,7 @@
 
 #include "radio.h"
 
+#include <hal/nrf_egu.h>
 #include <hal/nrf_power.h>
 
 #include <nrfx_timer.h>
@@ -26,10 +27,25 @@ uint32_t radio_is_active_counter = 0;
 
 #define RADIO_TEST_TIMER_INSTANCE 0
 
+/* Counts packets sent with a duty cycle, the END interrupt is off then */
+#define RADIO_TX_COUNTER NRF_TIMER3
+
+/* Times back to back packets at 16 MHz */
+#define RADIO_TX_PERIOD_TIMER NRF_TIMER4
+
+/* TXEN to READY with fast ramp-up, plus DISABLE, both ahead of the next
+ * TXEN of a duty-cycled TX
+ */
+#define RADIO_TX_TURNAROUND_US 50
+
 #define RADIO_TEST_EGU NRF_EGU0
 #define RADIO_TEST_EGU_EVENT NRF_EGU_EVENT_TRIGGERED0
 #define RADIO_TEST_EGU_TASK NRF_EGU_TASK_TRIGGER0
 
+/* Triggered by the ACK receiver once the ACK is written */
+#define RADIO_ACK_EGU_EVENT NRF_EGU_EVENT_TRIGGERED1
+#define RADIO_ACK_EGU_TASK NRF_EGU_TASK_TRIGGER1
+
 /* Frequency calculation for a given channel in the IEEE 802.15.4 radio
  * mode.
  */
@@ -39,10 +55,32 @@ uint32_t radio_is_active_counter = 0;
 /* Frequency calculation for a given channel. */
 #define CHAN_TO_FREQ(_channel) (2400 + _channel)
 
-/* Buffer for the radio TX packet */
-static uint8_t tx_packet[RADIO_MAX_PAYLOAD_LEN];
+/* PRBS payloads are written a word at a time, the last word may run past
+ * the packet
+ */
+#define RADIO_PACKET_BUF_LEN (RADIO_MAX_PAYLOAD_LEN + 4)
+
+/* Buffers for the radio TX packet, sequence numbered payloads alternate
+ * between them so one can be filled while the other is on air.
+ */
+static uint8_t tx_packet[2][RADIO_PACKET_BUF_LEN];
+/* Sequence number of the packet on air */
+static uint32_t tx_seq;
+/* Payloads change from packet to packet, refill them as they go out */
+static bool tx_refill;
 /* Buffer for the radio RX packet. */
-static uint8_t rx_packet[RADIO_MAX_PAYLOAD_LEN];
+#define RX_PACKET_BUFS 3
+/* Buffers for the radio RX packet, packet k is received into buffer k % 3.
+ * The END of packet k points PACKETPTR at buffer k + 2, so a completed
+ * buffer is left alone for two more packets.
+ */
+static uint8_t rx_packets[RX_PACKET_BUFS][RADIO_MAX_PAYLOAD_LEN] __aligned(4);
+/* Packets completed, only written by radio_handler() */
+static volatile uint32_t rx_done_count;
+/* Last completed packet */
+static const uint8_t *rx_packet = rx_packets[RX_PACKET_BUFS - 1];
+/* What the TX side sends, laid out like rx_packet for word compares */
+static uint8_t rx_expected[RADIO_PACKET_BUF_LEN] __aligned(4);
 /* Number of transmitted packets. */
 static uint32_t tx_packet_cnt;
 /* Number of received packets with valid CRC. */
@@ -53,30 +91,556 @@ static uint8_t rssi;
 /* Radio current channel (frequency). */
 static uint8_t current_channel;
 
+/* Channels swept over, while a sweep is running */
+static bool sweep_active;
+static uint8_t sweep_channel_start;
+static uint8_t sweep_channel_end;
+
+/* RX counters per channel */
+static struct radio_channel_stats channel_stats[RADIO_CHANNELS];
+
 /* Timer used for channel sweeps and tx with duty cycle. */
 static const nrfx_timer_t timer = NRFX_TIMER_INSTANCE(RADIO_TEST_TIMER_INSTANCE);
 
-/* Total payload size */
-static uint16_t total_payload_size;
+/* Register values setting up the framing of one radio mode, written as
+ * they are by radio_config(). MAXLEN is left out of PCNF1, it follows
+ * radio_packet_len.
+ */
+struct radio_profile
+{
+	uint32_t mode;
+	uint32_t modecnf0;
+	uint32_t pcnf0;
+	uint32_t pcnf1;
+	uint32_t crccnf;
+	uint32_t crcpoly;
+	uint32_t crcinit;
+
+	/* Longest LENGTH the mode allows */
+	uint8_t maxlen;
+	/* Bytes of LENGTH taken by the CRC, IEEE 802.15.4 counts its FCS */
+	uint8_t crc_in_length;
+
+	/* Airtime: a fixed part for the preamble and address (and on Coded PHY
+	 * CI and TERM1), then every bit from LENGTH on: LENGTH, payload, CRC
+	 * and TERM2
+	 */
+	uint16_t airtime_fixed_us;
+	uint16_t airtime_bit_ns;
+	uint8_t airtime_extra_bits;
+
+	/* Index of the mode among the RADIO_PHYS ones with a profile */
+	uint8_t phy;
+
+	/* Set by every profile, modes without one are zeroed */
+	bool valid;
+};
+
+#define RADIO_PCNF0(_plen, _cilen, _termlen, _crcinc)                                    \
+	((RADIO_LENGTH_LENGTH_FIELD << RADIO_PCNF0_LFLEN_Pos) |                              \
+	 (RADIO_PCNF0_PLEN_##_plen << RADIO_PCNF0_PLEN_Pos) | ((_cilen) << RADIO_PCNF0_CILEN_Pos) | \
+	 ((_termlen) << RADIO_PCNF0_TERMLEN_Pos) | ((_crcinc) << RADIO_PCNF0_CRCINC_Pos))
+
+#define RADIO_PCNF1(_balen, _endian, _whiteen)                  \
+	(((_balen) << RADIO_PCNF1_BALEN_Pos) |                        \
+	 (RADIO_PCNF1_ENDIAN_##_endian << RADIO_PCNF1_ENDIAN_Pos) |   \
+	 (RADIO_PCNF1_WHITEEN_##_whiteen << RADIO_PCNF1_WHITEEN_Pos))
+
+#define RADIO_CRCCNF(_len, _skipaddr)                    \
+	((RADIO_CRCCNF_LEN_##_len << RADIO_CRCCNF_LEN_Pos) | \
+	 (RADIO_CRCCNF_SKIPADDR_##_skipaddr << RADIO_CRCCNF_SKIPADDR_Pos))
+
+/* All modes ramp up fast. BLE modes use the BLE CRC over a 4 byte access
+ * address, nRF modes CRC-16-CCITT over a 5 byte address and IEEE 802.15.4
+ * its own PHY header, SFD and FCS.
+ */
+#define RADIO_MODECNF0_FAST                                   \
+	((RADIO_MODECNF0_RU_Fast << RADIO_MODECNF0_RU_Pos) |      \
+	 (RADIO_MODECNF0_DTX_Center << RADIO_MODECNF0_DTX_Pos))
+
+#define RADIO_PROFILE_NRF(_phy, _mode, _plen, _fixed_us, _bit_ns) \
+	{                                                           \
+		.mode = RADIO_MODE_MODE_##_mode,                        \
+		.modecnf0 = RADIO_MODECNF0_FAST,                        \
+		.pcnf0 = RADIO_PCNF0(_plen, 0, 0, 0),                   \
+		.pcnf1 = RADIO_PCNF1(4, Big, Enabled),                  \
+		.crccnf = RADIO_CRCCNF(Two, Include),                   \
+		.crcpoly = 0x11021,                                     \
+		.crcinit = 0xFFFF,                                      \
+		.maxlen = 255,                                          \
+		.airtime_fixed_us = (_fixed_us),                        \
+		.airtime_bit_ns = (_bit_ns),                            \
+		.airtime_extra_bits = 8 + 16,                           \
+		.phy = (_phy),                                          \
+		.valid = true,                                          \
+	}
+
+#define RADIO_PROFILE_BLE(_phy, _mode, _plen, _cilen, _termlen, _fixed_us, _bit_ns) \
+	{                                                           \
+		.mode = RADIO_MODE_MODE_##_mode,                        \
+		.modecnf0 = RADIO_MODECNF0_FAST,                        \
+		.pcnf0 = RADIO_PCNF0(_plen, _cilen, _termlen, 0),       \
+		.pcnf1 = RADIO_PCNF1(3, Little, Enabled),               \
+		.crccnf = RADIO_CRCCNF(Three, Skip),                    \
+		.crcpoly = 0x65B,                                       \
+		.crcinit = 0x555555,                                    \
+		.maxlen = 255,                                          \
+		.airtime_fixed_us = (_fixed_us),                        \
+		.airtime_bit_ns = (_bit_ns),                            \
+		.airtime_extra_bits = 8 + 24 + (_termlen),              \
+		.phy = (_phy),                                          \
+		.valid = true,                                          \
+	}
+
+static const struct radio_profile radio_profiles[] = {
+	/* 8 + 40 bits at 1 Mbps, 16 + 40 at 2 Mbps */
+	[RADIO_MODE_MODE_Nrf_1Mbit] = RADIO_PROFILE_NRF(0, Nrf_1Mbit, 8bit, 48, 1000),
+	[RADIO_MODE_MODE_Nrf_2Mbit] = RADIO_PROFILE_NRF(1, Nrf_2Mbit, 16bit, 28, 500),
+	/* 8 + 32 bits at 1 Mbps, 16 + 32 at 2 Mbps */
+	[RADIO_MODE_MODE_Ble_1Mbit] = RADIO_PROFILE_BLE(2, Ble_1Mbit, 8bit, 0, 0, 40, 1000),
+	[RADIO_MODE_MODE_Ble_2Mbit] = RADIO_PROFILE_BLE(3, Ble_2Mbit, 16bit, 0, 0, 24, 500),
+	/* 80 us preamble, then 32 + 2 + 3 bits at S=8 in FEC block 1, FEC
+	 * block 2 at S=8 or S=2
+	 */
+	[RADIO_MODE_MODE_Ble_LR125Kbit] = RADIO_PROFILE_BLE(4, Ble_LR125Kbit, LongRange, 2, 3, 376, 8000),
+	[RADIO_MODE_MODE_Ble_LR500Kbit] = RADIO_PROFILE_BLE(5, Ble_LR500Kbit, LongRange, 2, 3, 376, 2000),
+	[RADIO_MODE_MODE_Ieee802154_250Kbit] = {
+		.mode = RADIO_MODE_MODE_Ieee802154_250Kbit,
+		.modecnf0 = RADIO_MODECNF0_FAST,
+		.pcnf0 = RADIO_PCNF0(32bitZero, 0, 0, 1),
+		.pcnf1 = RADIO_PCNF1(0, Little, Disabled),
+		.crccnf = RADIO_CRCCNF(Two, Ieee802154),
+		.crcpoly = 0x11021,
+		.crcinit = 0,
+		.maxlen = IEEE_MAX_PAYLOAD_LEN,
+		.crc_in_length = 2,
+		/* 4 preamble bytes and the SFD, then PHR and PSDU, at 32 us a byte */
+		.airtime_fixed_us = 160,
+		.airtime_bit_ns = 4000,
+		.airtime_extra_bits = 8,
+		.phy = 6,
+		.valid = true,
+	},
+};
+
+/* Profile of the mode the radio was last configured for */
+static const struct radio_profile *radio_profile = &radio_profiles[RADIO_MODE_MODE_Ble_LR125Kbit];
+
+/* TIMER2 runs at 8 MHz for the duration of a test */
+#define RADIO_TIMESTAMP_HZ 8000000
+
+/* TIMER2 when TX started and stopped, captured into CC[2] */
+static uint32_t tx_start_ticks;
+static uint32_t tx_end_ticks;
+static bool tx_running;
 
 /* PPI channel for starting radio */
 static uint8_t ppi_radio_start;
 
+/* PPI channel disabling the radio on TIMER0 COMPARE0, to hop channels */
+static uint8_t ppi_radio_disable;
+
+/* PPI channel capturing TIMER2 into CC[1] on every ADDRESS while receiving */
+static uint8_t ppi_rx_timestamp;
+
+/* PPI channel counting the end of every duty-cycled packet on
+ * RADIO_TX_COUNTER
+ */
+static uint8_t ppi_tx_end;
+
+static bool tx_duty_cycle_active;
+static int64_t tx_duty_cycle_start_ms;
+
+/* PPI channels sending exactly `packets_num` packets. Every end of packet
+ * counts on RADIO_TX_COUNTER and starts the next one, until the count
+ * reaches packets_num - 1: that swaps the channel group starting the next
+ * packet for the one disabling the radio after the last.
+ */
+static uint8_t ppi_tx_next;
+static uint8_t ppi_tx_last;
+static uint8_t ppi_tx_count_reached;
+static nrfx_gppi_channel_group_t tx_group_next;
+static nrfx_gppi_channel_group_t tx_group_last;
+
+/* PPI channel capturing RADIO_TX_PERIOD_TIMER into CC[0] at the end of
+ * every back to back packet, the first one starts the timer
+ */
+static uint8_t ppi_tx_period;
+static bool tx_throughput_active;
+
+/* Back to back TX: mean time from the end of one packet to the end of the
+ * next, in ns
+ */
+uint32_t radio_tx_period_ns;
+
+/* Ping-pong: the initiator sends a ping and the END_DISABLE and
+ * DISABLED_RXEN shorts turn the radio round to receive the echo into the
+ * same buffer, the responder's DISABLED_TXEN short sends every packet it
+ * receives straight back. The DISABLED interrupt flips the shorts for the
+ * next direction.
+ */
+static bool ping_active;
+static bool pong_active;
+static uint32_t ping_seq;
+static uint32_t ping_count;
+static uint8_t ping_packet[RADIO_PACKET_BUF_LEN] __aligned(4);
+
+/* Times exchanges at 1 MHz: TXREADY of the ping clears and starts it,
+ * ADDRESS captures it into CC[1], the echo's last, and COMPARE0 gives up
+ * on the echo
+ */
+#define RADIO_RTT_TIMER NRF_TIMER4
+/* Echo wait on top of the airtime of both packets */
+#define RADIO_RTT_MARGIN_US 500
+
+static uint8_t ppi_rtt_start;
+static uint8_t ppi_rtt_capture;
+static uint8_t ppi_rtt_timeout;
+
+/* Round trip times per PHY, each test only clears its own */
+static struct radio_rtt_stats rtt_stats[RADIO_PHYS];
+
+/* Auto-acknowledged frames: the transmitter sends a frame from ping_packet
+ * and the END_DISABLE and DISABLED_RXEN shorts turn it round to receive the
+ * ACK into the same buffer, retrying up to `ack_retries` times before
+ * giving up on the frame. Every attempt fills and stamps the frame again.
+ *
+ * The receiver writes the ACK into ack_packet and points PACKETPTR at it
+ * from the DISABLED interrupt, then triggers RADIO_ACK_EGU_TASK. Only
+ * ack_group connects that to TXEN, and only CRCOK enables the group; its
+ * channel disables the group again. So the radio cannot ramp up for an ACK
+ * before the ACK is written, and a frame failing its CRC is never
+ * acknowledged. Interrupt latency only delays the ACK, and the
+ * transmitter's timeout allows for it.
+ */
+static bool ack_tx_active;
+static bool ack_rx_active;
+static bool ack_sending;
+static uint8_t ack_retries;
+static uint8_t ack_attempt;
+static uint32_t ack_seq;
+static uint32_t ack_count;
+static uint32_t ack_last_seq;
+static bool ack_have_last;
+static uint8_t ack_packet[RADIO_PACKET_BUF_LEN] __aligned(4);
+static struct radio_ack_stats ack_stats;
+
+static uint8_t ppi_ack_arm;
+static uint8_t ppi_ack_send;
+static nrfx_gppi_channel_group_t ack_group;
+
+/* An ACK carries the sequence number of the frame it acknowledges */
+#define RADIO_ACK_PAYLOAD_LEN 4
+
+/* Frames acknowledged in the last ACK_TX test */
+uint32_t radio_frames_delivered;
+
+/* Called from the DISABLED interrupt once the last counted packet is sent */
+static void (*tx_done_cb)(void);
+static bool tx_count_active;
+
+/* PPI channels and groups are allocated per feature the first time a test
+ * needs them, and kept after, so a session only holds what it has run. All
+ * of them together are 13 of the 20 programmable channels of the nRF52840
+ * and 3 of its 6 groups; one test takes at most 4 channels and 2 groups.
+ * A feature whose allocation fails only fails the tests that need it.
+ */
+#define RADIO_PPI_SET_CHANNELS 3
+#define RADIO_PPI_SET_GROUPS 2
+
+struct radio_ppi_set
+{
+	uint8_t *channels[RADIO_PPI_SET_CHANNELS];
+	nrfx_gppi_channel_group_t *groups[RADIO_PPI_SET_GROUPS];
+	bool allocated;
+};
+
+static struct radio_ppi_set ppi_set_rx = {.channels = {&ppi_rx_timestamp}};
+static struct radio_ppi_set ppi_set_sweep = {.channels = {&ppi_radio_disable}};
+static struct radio_ppi_set ppi_set_tx_end = {.channels = {&ppi_tx_end}};
+static struct radio_ppi_set ppi_set_tx_count = {
+	.channels = {&ppi_tx_next, &ppi_tx_last, &ppi_tx_count_reached},
+	.groups = {&tx_group_next, &tx_group_last},
+};
+static struct radio_ppi_set ppi_set_duty_cycle = {.channels = {&ppi_radio_start}};
+static struct radio_ppi_set ppi_set_throughput = {.channels = {&ppi_tx_period}};
+static struct radio_ppi_set ppi_set_rtt = {.channels = {&ppi_rtt_start, &ppi_rtt_capture, &ppi_rtt_timeout}};
+static struct radio_ppi_set ppi_set_ack = {
+	.channels = {&ppi_ack_arm, &ppi_ack_send},
+	.groups = {&ack_group},
+};
+
 /* Packet size to use */
 uint8_t packet_size = RADIO_MAX_PAYLOAD_LEN - 1;
 
+/* Packet size the radio was last configured for, packet_size within the
+ * MAXLEN of the mode
+ */
+static uint8_t radio_packet_len = RADIO_MAX_PAYLOAD_LEN - 1;
+
+/* Stamp TX payloads with a sequence number, and check them on RX */
+bool radio_sequence;
+
+/* Count bit errors in every received payload, CRC failed or not */
+bool radio_ber;
+
+/* Pattern of the running test */
+static enum transmit_pattern radio_pattern;
+
 /* RX packets statistics */
 uint32_t radio_total_rssi;
 uint32_t radio_packets_received;
 uint32_t radio_total_crcok;
 bool radio_has_received;
+/* Updated in radio_handler(), copy it with interrupts locked */
+static struct radio_rssi_stats rssi_stats = {.min = UINT8_MAX};
+/* Same */
+static struct radio_seq_stats seq_stats;
+static struct radio_ber_stats ber_stats;
 // For logging
-static uint8_t rx_log_buf[RADIO_MAX_PAYLOAD_LEN + 4 * 4 + 2];
+#define RX_LOG_HEADER_LEN (18 + RADIO_RSSI_STATS_LEN)
+#define RX_LOG_PERIOD_MS 250
+/* Snapshots that can wait for the flash, 2 s worth */
+#define RX_LOG_QUEUE_LEN 8
+
+/* The counters of a snapshot of the RX statistics, len 0 asks the writer
+ * to report back. The writer adds the last packet.
+ */
+struct rx_log_msg
+{
+	uint16_t len;
+	uint8_t buf[RX_LOG_HEADER_LEN];
+};
+
+K_MSGQ_DEFINE(rx_log_msgq, sizeof(struct rx_log_msg), RX_LOG_QUEUE_LEN, 4);
+static K_SEM_DEFINE(rx_log_drained, 0, 1);
+/* Given for every snapshot queued and when the event ring fills up */
+static K_SEM_DEFINE(rx_log_wake, 0, 1);
+
+/* Filled in the timer ISR */
+static struct rx_log_msg rx_log_snapshot;
+
 bool radio_logging_active = false;
+uint32_t radio_log_snapshots;
+uint32_t radio_log_dropped;
+
+/* Per-packet RX events, filled by radio_handler() and drained by the writer.
+ * Single producer, single consumer: the head is only written by the ISR and
+ * the tail only by the writer, so neither needs a lock.
+ */
+/* Power of two. The shortest packets at 2 Mbit come about 50 us apart, so
+ * that is ~25 ms of them, half of it left when the writer is woken.
+ */
+#define RX_EVENT_RING_LEN 512
+/* Fill at which rx_event_push() wakes the writer */
+#define RX_EVENT_HIGH_WATER (RX_EVENT_RING_LEN / 2)
+#define RX_EVENT_SIZE 8
+#define RX_EVENTS_PER_RECORD 32
+/* How often the writer looks at the ring when nothing wakes it */
+#define RX_EVENT_DRAIN_MS 50
+
+#define RX_EVENT_CRC_OK BIT(0)
+
+struct rx_event
+{
+	uint32_t timestamp; /* TIMER2 at ADDRESS */
+	uint8_t rssi;
+	uint8_t flags;
+	uint8_t len;
+	uint8_t dropped; /* Events lost to a full ring right before this one */
+};
+
+static struct rx_event rx_event_ring[RX_EVENT_RING_LEN];
+static volatile uint32_t rx_event_head;
+static volatile uint32_t rx_event_tail;
+/* Events lost since the last one pushed, only touched by the ISR */
+static uint32_t rx_event_gap;
+
+uint32_t radio_rx_events;
+uint32_t radio_rx_events_dropped;
+
+/* END is also enabled while receiving, for the per-packet events */
+static bool radio_receiving;
 
 /* TX packets statistics */
 uint32_t radio_packets_sent;
 
+/* Duty-cycled TX: time on air of one packet in ns, and the share of the
+ * time spent on air in ppm, once the test is cancelled
+ */
+uint32_t radio_tx_airtime_ns;
+uint32_t radio_tx_duty_cycle_ppm;
+
+static void put_u32(uint8_t *buf, uint32_t value)
+{
+	buf[0] = value & 0xFF;
+	buf[1] = (value >> 8) & 0xFF;
+	buf[2] = (value >> 16) & 0xFF;
+	buf[3] = (value >> 24) & 0xFF;
+}
+
+static uint32_t get_u32(const uint8_t *buf)
+{
+	return buf[0] | buf[1] << 8 | buf[2] << 16 | (uint32_t)buf[3] << 24;
+}
+
+/* PRBS9 (x^9 + x^5 + 1) and PRBS15 (x^15 + x^14 + 1) a word at a time. Bit j
+ * of word k is bit 32k + j of the sequence, the order the radio sends a
+ * little endian word in. Squaring the polynomials pushes the taps back by
+ * at least a word, so a whole word follows from the previous ones:
+ *   PRBS9   s[n] = s[n - 40] ^ s[n - 72]
+ *   PRBS15  s[n] = s[n - 56] ^ s[n - 60]
+ */
+struct prbs
+{
+	enum transmit_pattern pattern;
+	/* Last three words, newest first */
+	uint32_t w[3];
+};
+
+static struct prbs tx_prbs;
+
+static inline uint32_t prbs_next(struct prbs *prbs)
+{
+	uint64_t h = (uint64_t)prbs->w[0] << 32 | prbs->w[1];
+	uint32_t next;
+
+	if (prbs->pattern == TRANSMIT_PATTERN_PRBS15)
+	{
+		next = (uint32_t)(h >> 8) ^ (uint32_t)(h >> 4);
+	}
+	else
+	{
+		uint64_t g = (uint64_t)prbs->w[1] << 32 | prbs->w[2];
+
+		next = (uint32_t)(h >> 24) ^ (uint32_t)(g >> 24);
+	}
+
+	prbs->w[2] = prbs->w[1];
+	prbs->w[1] = prbs->w[0];
+	prbs->w[0] = next;
+
+	return next;
+}
+
+/* Runs the generator bit by bit from the all ones state for its first words */
+static void prbs_seed(struct prbs *prbs, enum transmit_pattern pattern)
+{
+	uint8_t len = pattern == TRANSMIT_PATTERN_PRBS15 ? 15 : 9;
+	uint8_t tap = pattern == TRANSMIT_PATTERN_PRBS15 ? 14 : 5;
+	uint32_t words[3] = {0};
+
+	for (int n = 0; n < 96; n++)
+	{
+		uint32_t bit = 1;
+
+		if (n >= len)
+		{
+			bit = ((words[(n - tap) / 32] >> ((n - tap) % 32)) ^
+				   (words[(n - len) / 32] >> ((n - len) % 32))) &
+				  1;
+		}
+		words[n / 32] |= bit << (n % 32);
+	}
+
+	prbs->pattern = pattern;
+	prbs->w[0] = words[2];
+	prbs->w[1] = words[1];
+	prbs->w[2] = words[0];
+}
+
+static bool radio_pattern_is_prbs(void)
+{
+	return radio_pattern == TRANSMIT_PATTERN_RANDOM || radio_pattern == TRANSMIT_PATTERN_PRBS15;
+}
+
+/* The pattern starts after any sequence header */
+static uint16_t radio_payload_first(void)
+{
+	return 1 + (radio_sequence ? RADIO_SEQ_HEADER_LEN : 0);
+}
+
+/* End of the payload in the packet buffer, a CRC counted in LENGTH is
+ * never written to it
+ */
+static uint16_t radio_payload_end(void)
+{
+	return 1 + radio_packet_len - radio_profile->crc_in_length;
+}
+
+static uint32_t radio_airtime_ns(uint8_t length)
+{
+	return radio_profile->airtime_fixed_us * 1000 +
+		   (radio_profile->airtime_extra_bits + 8 * length) * radio_profile->airtime_bit_ns;
+}
+
+static uint32_t timer2_ticks(void)
+{
+	nrf_timer_task_trigger(NRF_TIMER2, NRF_TIMER_TASK_CAPTURE2);
+	return nrf_timer_cc_get(NRF_TIMER2, NRF_TIMER_CC_CHANNEL2);
+}
+
+static void tx_elapsed_start(void)
+{
+	tx_start_ticks = timer2_ticks();
+	tx_end_ticks = tx_start_ticks;
+	tx_running = true;
+}
+
+static void tx_elapsed_stop(void)
+{
+	if (tx_running)
+	{
+		tx_end_ticks = timer2_ticks();
+		tx_running = false;
+	}
+}
+
+/* Payload every packet carries, the sequence header is written over it.
+ * PRBS payloads carry the next words of the sequence.
+ */
+static void radio_payload_fill(uint8_t *packet)
+{
+	packet[0] = radio_packet_len;
+
+	switch (radio_pattern)
+	{
+	case TRANSMIT_PATTERN_RANDOM:
+	case TRANSMIT_PATTERN_PRBS15:
+		for (uint16_t i = radio_payload_first(); i < radio_payload_end(); i += 4)
+		{
+			put_u32(packet + i, prbs_next(&tx_prbs));
+		}
+		break;
+
+	case TRANSMIT_PATTERN_11001100:
+		memset(packet + 1, 0xCC, RADIO_MAX_PAYLOAD_LEN - 1);
+		break;
+
+	default:
+		memset(packet + 1, 0xF0, RADIO_MAX_PAYLOAD_LEN - 1);
+		break;
+	}
+}
+
+/* Writes the sequence header into a TX payload:
+ *   0  sequence number, 4 bytes, counting up from 0
+ *   4  TIMER2 when the payload was written, 4 bytes, about one packet
+ *      before it goes on air
+ */
+static void tx_sequence_stamp(uint8_t *packet, uint32_t seq)
+{
+	if (packet[0] < RADIO_SEQ_HEADER_LEN)
+	{
+		return;
+	}
+
+	NRF_TIMER2->TASKS_CAPTURE[3] = TIMER_TASKS_CAPTURE_TASKS_CAPTURE_Trigger;
+
+	put_u32(packet + 1, seq);
+	put_u32(packet + 5, NRF_TIMER2->CC[3]);
+}
+
 static void radio_power_set(nrf_radio_mode_t mode, uint8_t channel, int8_t power)
 {
 	int8_t radio_power = power;
@@ -95,63 +659,49 @@ static void radio_channel_set(nrf_radio_mode_t mode, uint8_t channel)
 	nrf_radio_frequency_set(NRF_RADIO, frequency);
 }
 
-static void radio_config(nrf_radio_mode_t mode, enum transmit_pattern pattern)
+static const struct radio_profile *radio_profile_get(nrf_radio_mode_t mode)
+{
+	if (mode < ARRAY_SIZE(radio_profiles) && radio_profiles[mode].valid)
+	{
+		return &radio_profiles[mode];
+	}
+
+	printk("radio_profile_get: no profile for mode %u, using Coded PHY\n", mode);
+	return &radio_profiles[RADIO_MODE_MODE_Ble_LR125Kbit];
+}
+
+uint8_t radio_packet_len_get(nrf_radio_mode_t mode)
 {
-	nrf_radio_packet_conf_t packet_conf;
+	return MIN(packet_size, radio_profile_get(mode)->maxlen);
+}
 
-	/* Set fast ramp-up time. */
-	nrf_radio_modecnf0_set(NRF_RADIO, true, RADIO_MODECNF0_DTX_Center);
-	/* Disable CRC. */
-	nrf_radio_crc_configure(NRF_RADIO, RADIO_CRCCNF_LEN_Disabled,
-							NRF_RADIO_CRC_ADDR_INCLUDE, 0);
+/* Applies the profile of `mode` as a block of register writes */
+static void radio_config(nrf_radio_mode_t mode)
+{
+	const struct radio_profile *profile = radio_profile_get(mode);
 
-	/* Set the device address 0 to use when transmitting. */
-	nrf_radio_txaddress_set(NRF_RADIO, 0);
-	/* Enable the device address 0 to use to select which addresses to
-	 * receive
-	 */
-	nrf_radio_rxaddresses_set(NRF_RADIO, 1);
-	nrf_radio_prefix0_set(NRF_RADIO, 0x6A);
-	nrf_radio_base0_set(NRF_RADIO, 0x58FE811B);
-
-	/* Packet configuration:
-	 * payload length size = 8 bits,
-	 * 0-byte static length, max 255-byte payload,
-	 * 4-byte base address length (5-byte full address length),
-	 * Bit 24: 1 Big endian,
-	 * Bit 25: 1 Whitening enabled.
-	 */
-	memset(&packet_conf, 0, sizeof(packet_conf));
-	packet_conf.lflen = RADIO_LENGTH_LENGTH_FIELD;
-	packet_conf.maxlen = packet_size;
-	// packet_conf.maxlen = (sizeof(tx_packet) - 1);
-	packet_conf.statlen = 0;
-	packet_conf.balen = 4;
-	packet_conf.big_endian = true;
-	packet_conf.whiteen = true;
-
-	/* Packet configuration:
-	 * S1 size = 0 bits,
-	 * S0 size = 0 bytes,
-	 * 10 bytes preamble.
-	 */
-	packet_conf.plen = NRF_RADIO_PREAMBLE_LENGTH_LONG_RANGE;
-	packet_conf.cilen = 2;
-	packet_conf.termlen = 3;
-	packet_conf.big_endian = false;
-	packet_conf.balen = 3;
-
-	/* Set CRC length; CRC calculation does not include the address
-	 * field.
-	 */
-	nrf_radio_crc_configure(NRF_RADIO, RADIO_CRCCNF_LEN_Three,
-							NRF_RADIO_CRC_ADDR_SKIP, 0);
+	radio_profile = profile;
 
-	/* preamble, address (BALEN + PREFIX), lflen, code indicator, TERM, payload, CRC */
-	total_payload_size = 10 + (packet_conf.balen + 1) + 1 + packet_conf.cilen +
-						 packet_conf.termlen + packet_conf.maxlen + RADIO_CRCCNF_LEN_Three;
+	radio_packet_len = radio_packet_len_get(mode);
+	if (radio_packet_len < packet_size)
+	{
+		printk("radio_config: packet size %u cut to %u\n", packet_size, radio_packet_len);
+	}
 
-	nrf_radio_packet_configure(NRF_RADIO, &packet_conf);
+	NRF_RADIO->MODE = profile->mode;
+	NRF_RADIO->MODECNF0 = profile->modecnf0;
+	NRF_RADIO->PCNF0 = profile->pcnf0;
+	NRF_RADIO->PCNF1 = profile->pcnf1 | (radio_packet_len << RADIO_PCNF1_MAXLEN_Pos);
+	NRF_RADIO->CRCCNF = profile->crccnf;
+	NRF_RADIO->CRCPOLY = profile->crcpoly;
+	NRF_RADIO->CRCINIT = profile->crcinit;
+
+	/* Address 0 for both TX and RX, IEEE 802.15.4 matches on its SFD */
+	NRF_RADIO->TXADDRESS = 0;
+	NRF_RADIO->RXADDRESSES = 1;
+	NRF_RADIO->PREFIX0 = 0x6A;
+	NRF_RADIO->BASE0 = 0x58FE811B;
+	NRF_RADIO->SFD = 0xA7;
 }
 
 static void radio_disable(void)
@@ -168,21 +718,30 @@ static void radio_disable(void)
 	nrf_radio_event_clear(NRF_RADIO, NRF_RADIO_EVENT_DISABLED);
 }
 
-static void radio_mode_set(NRF_RADIO_Type *reg, nrf_radio_mode_t mode)
+static void radio_modulated_tx_config(uint8_t mode, int8_t txpower, uint8_t channel,
+									  enum transmit_pattern pattern)
 {
+	if (ppi_set_rx.allocated)
+	{
+		nrfx_gppi_channels_disable(BIT(ppi_rx_timestamp));
+	}
+	radio_disable();
+	radio_config(mode);
 
-	nrf_radio_mode_set(reg, mode);
-}
+	radio_pattern = pattern;
+	prbs_seed(&tx_prbs, pattern);
+	tx_refill = radio_sequence || radio_pattern_is_prbs();
 
-static void radio_modulated_tx_carrier(uint8_t mode, int8_t txpower, uint8_t channel,
-									   enum transmit_pattern pattern)
-{
-	radio_disable();
-	radio_config(mode, pattern);
 	// tx_packet[0] = sizeof(tx_packet) - 1;
-	tx_packet[0] = packet_size;
-	memset(tx_packet + 1, 0xF0, sizeof(tx_packet) - 1);
-	nrf_radio_packetptr_set(NRF_RADIO, tx_packet);
+	radio_payload_fill(tx_packet[0]);
+	memcpy(tx_packet[1], tx_packet[0], sizeof(tx_packet[1]));
+
+	tx_seq = 0;
+	if (radio_sequence)
+	{
+		tx_sequence_stamp(tx_packet[0], tx_seq);
+	}
+	nrf_radio_packetptr_set(NRF_RADIO, tx_packet[0]);
 
 	if (mode == RADIO_MODE_MODE_Ble_LR125Kbit || mode == RADIO_MODE_MODE_Ble_LR500Kbit)
 	{
@@ -197,12 +756,13 @@ static void radio_modulated_tx_carrier(uint8_t mode, int8_t txpower, uint8_t cha
 									NRF_RADIO_SHORT_END_START_MASK);
 	}
 
-	radio_mode_set(NRF_RADIO, mode);
 	radio_power_set(mode, channel, txpower);
 
 	radio_channel_set(mode, channel);
+	current_channel = channel;
 
 	tx_packet_cnt = 0;
+	radio_receiving = false;
 
 	nrf_radio_event_clear(NRF_RADIO, NRF_RADIO_EVENT_END);
 	nrf_radio_event_clear(NRF_RADIO, NRF_RADIO_EVENT_PHYEND);
@@ -216,185 +776,1808 @@ static void radio_modulated_tx_carrier(uint8_t mode, int8_t txpower, uint8_t cha
 		nrf_radio_int_enable(NRF_RADIO, NRF_RADIO_INT_END_MASK);
 	}
 
-	nrf_radio_task_trigger(NRF_RADIO, NRF_RADIO_TASK_TXEN);
+	/* The next payload is prepared once the current one is on air */
+	if (tx_refill)
+	{
+		nrf_radio_event_clear(NRF_RADIO, NRF_RADIO_EVENT_ADDRESS);
+		nrf_radio_int_enable(NRF_RADIO, NRF_RADIO_INT_ADDRESS_MASK);
+	}
 }
 
-static void radio_rx(uint8_t mode, uint8_t channel, enum transmit_pattern pattern)
+/* RADIO_TX_COUNTER counts packets from 0, fed over PPI */
+static void tx_counter_start(void)
 {
-	radio_disable();
-
-	radio_mode_set(NRF_RADIO, mode);
-	nrf_radio_shorts_enable(NRF_RADIO,
-							NRF_RADIO_SHORT_READY_START_MASK |
-								NRF_RADIO_SHORT_END_START_MASK |
-								NRF_RADIO_SHORT_ADDRESS_RSSISTART_MASK |
-								NRF_RADIO_SHORT_DISABLED_RSSISTOP_MASK);
-	nrf_radio_packetptr_set(NRF_RADIO, rx_packet);
+	nrf_timer_task_trigger(RADIO_TX_COUNTER, NRF_TIMER_TASK_STOP);
+	nrf_timer_mode_set(RADIO_TX_COUNTER, NRF_TIMER_MODE_COUNTER);
+	nrf_timer_bit_width_set(RADIO_TX_COUNTER, NRF_TIMER_BIT_WIDTH_32);
+	nrf_timer_task_trigger(RADIO_TX_COUNTER, NRF_TIMER_TASK_CLEAR);
+	nrf_timer_task_trigger(RADIO_TX_COUNTER, NRF_TIMER_TASK_START);
+}
 
-	radio_config(mode, pattern);
-	radio_channel_set(mode, channel);
+static uint32_t tx_counter_stop(void)
+{
+	nrf_timer_task_trigger(RADIO_TX_COUNTER, NRF_TIMER_TASK_CAPTURE1);
+	nrf_timer_task_trigger(RADIO_TX_COUNTER, NRF_TIMER_TASK_STOP);
 
-	rx_packet_cnt = 0;
+	return nrf_timer_cc_get(RADIO_TX_COUNTER, NRF_TIMER_CC_CHANNEL1);
+}
 
-	nrf_radio_int_enable(NRF_RADIO,
-						 NRF_RADIO_INT_CRCOK_MASK |
-							 NRF_RADIO_INT_RSSIEND_MASK |
-							 NRF_RADIO_INT_ADDRESS_MASK);
+static void radio_modulated_tx_carrier(uint8_t mode, int8_t txpower, uint8_t channel,
+									   enum transmit_pattern pattern)
+{
+	radio_modulated_tx_config(mode, txpower, channel, pattern);
 
-	nrf_radio_task_trigger(NRF_RADIO, NRF_RADIO_TASK_RXEN);
+	nrf_radio_task_trigger(NRF_RADIO, NRF_RADIO_TASK_TXEN);
 }
 
-void radio_test_start(const struct radio_test_config *config)
+/* Sends exactly `packets_num` packets back to back and calls `cb` once
+ * the radio is disabled after the last, the packets are counted and the
+ * radio stopped over PPI
+ */
+static void radio_modulated_tx_count(uint8_t mode, int8_t txpower, uint8_t channel,
+									 enum transmit_pattern pattern, uint32_t packets_num,
+									 void (*cb)(void))
 {
-	switch (config->type)
+	bool long_range = mode == RADIO_MODE_MODE_Ble_LR125Kbit || mode == RADIO_MODE_MODE_Ble_LR500Kbit;
+	uint32_t end = nrf_radio_event_address_get(NRF_RADIO, long_range ? NRF_RADIO_EVENT_PHYEND
+																	 : NRF_RADIO_EVENT_END);
+
+	radio_modulated_tx_config(mode, txpower, channel, pattern);
+
+	/* Packets follow each other over PPI instead of the END_START short */
+	nrf_radio_shorts_set(NRF_RADIO, NRF_RADIO_SHORT_READY_START_MASK);
+
+	tx_counter_start();
+	nrf_timer_cc_set(RADIO_TX_COUNTER, NRF_TIMER_CC_CHANNEL0, packets_num - 1);
+
+	nrfx_gppi_channel_endpoints_setup(ppi_tx_end, end,
+									  nrf_timer_task_address_get(RADIO_TX_COUNTER, NRF_TIMER_TASK_COUNT));
+	nrfx_gppi_channel_endpoints_setup(ppi_tx_next, end,
+									  nrf_radio_task_address_get(NRF_RADIO, NRF_RADIO_TASK_START));
+	nrfx_gppi_channel_endpoints_setup(ppi_tx_last, end,
+									  nrf_radio_task_address_get(NRF_RADIO, NRF_RADIO_TASK_DISABLE));
+	nrfx_gppi_channel_endpoints_setup(ppi_tx_count_reached,
+									  nrf_timer_event_address_get(RADIO_TX_COUNTER, NRF_TIMER_EVENT_COMPARE0),
+									  nrfx_gppi_task_address_get(nrfx_gppi_group_disable_task_get(tx_group_next)));
+	nrfx_gppi_fork_endpoint_setup(ppi_tx_count_reached,
+								  nrfx_gppi_task_address_get(nrfx_gppi_group_enable_task_get(tx_group_last)));
+
+	nrfx_gppi_channels_group_set(BIT(ppi_tx_next), tx_group_next);
+	nrfx_gppi_channels_group_set(BIT(ppi_tx_last), tx_group_last);
+	nrfx_gppi_group_disable(tx_group_last);
+	nrfx_gppi_channels_disable(BIT(ppi_tx_next) | BIT(ppi_tx_last));
+
+	/* A count of packets_num - 1 never compares for a single packet */
+	if (packets_num > 1)
 	{
-	case MODULATED_TX:
-		radio_modulated_tx_carrier(config->mode,
-								   config->params.modulated_tx.txpower,
-								   config->params.modulated_tx.channel,
-								   config->params.modulated_tx.pattern);
-		break;
-	case RX:
-		radio_rx(config->mode,
-				 config->params.rx.channel,
-				 config->params.rx.pattern);
-		break;
+		nrfx_gppi_group_enable(tx_group_next);
+		nrfx_gppi_channels_enable(BIT(ppi_tx_count_reached));
+	}
+	else
+	{
+		nrfx_gppi_group_enable(tx_group_last);
 	}
+	nrfx_gppi_channels_enable(BIT(ppi_tx_end));
+
+	tx_done_cb = cb;
+	tx_count_active = true;
+
+	nrf_radio_event_clear(NRF_RADIO, NRF_RADIO_EVENT_DISABLED);
+	nrf_radio_int_enable(NRF_RADIO, NRF_RADIO_INT_DISABLED_MASK);
+
+	nrf_radio_task_trigger(NRF_RADIO, NRF_RADIO_TASK_TXEN);
 }
 
-void radio_test_cancel(void)
+static void radio_tx_count_stop(void)
+{
+	nrfx_gppi_group_disable(tx_group_next);
+	nrfx_gppi_group_disable(tx_group_last);
+	nrfx_gppi_channels_disable(BIT(ppi_tx_end) | BIT(ppi_tx_count_reached));
+	nrfx_gppi_channels_remove_from_group(BIT(ppi_tx_next), tx_group_next);
+	nrfx_gppi_channels_remove_from_group(BIT(ppi_tx_last), tx_group_last);
+
+	tx_counter_stop();
+
+	tx_count_active = false;
+}
+
+/* Sends one packet per period without the CPU: TIMER0 COMPARE1 enables TX
+ * over PPI, READY starts the packet and its end disables the radio again.
+ * The first packet goes out right away to time it, the period then puts
+ * the radio on air `duty_cycle` percent of the time.
+ */
+static void radio_modulated_tx_duty_cycle(uint8_t mode, int8_t txpower, uint8_t channel,
+										  enum transmit_pattern pattern, uint32_t duty_cycle)
 {
-	nrfx_timer_disable(&timer);
-	nrfx_timer_clear(&timer);
+	bool long_range = mode == RADIO_MODE_MODE_Ble_LR125Kbit || mode == RADIO_MODE_MODE_Ble_LR500Kbit;
+
+	radio_modulated_tx_config(mode, txpower, channel, pattern);
+
+	/* Only refilling the payload may still interrupt */
+	nrf_radio_int_disable(NRF_RADIO, NRF_RADIO_INT_END_MASK | NRF_RADIO_INT_PHYEND_MASK);
+	nrf_radio_shorts_set(NRF_RADIO,
+						 NRF_RADIO_SHORT_READY_START_MASK |
+							 (long_range ? NRF_RADIO_SHORT_PHYEND_DISABLE_MASK
+										 : NRF_RADIO_SHORT_END_DISABLE_MASK));
+
+	tx_counter_start();
+
+	/* TIMER0 is MPSL's while BT runs, set it up from scratch */
+	nrf_timer_task_trigger(timer.p_reg, NRF_TIMER_TASK_STOP);
+	nrf_timer_mode_set(timer.p_reg, NRF_TIMER_MODE_TIMER);
+	nrf_timer_bit_width_set(timer.p_reg, NRF_TIMER_BIT_WIDTH_32);
+	nrf_timer_frequency_set(timer.p_reg, NRF_TIMER_FREQ_1MHz);
+	nrf_timer_int_disable(timer.p_reg, ~0);
+	nrf_timer_shorts_set(timer.p_reg, NRF_TIMER_SHORT_COMPARE1_CLEAR_MASK);
+	nrf_timer_task_trigger(timer.p_reg, NRF_TIMER_TASK_CLEAR);
+
+	/* The profile gives the airtime from READY to the end of the packet, so
+	 * the period is known before the first packet goes out
+	 */
+	radio_tx_airtime_ns = radio_airtime_ns(radio_packet_len);
 
-	// sweep_processing = false;
+	uint32_t airtime_us = DIV_ROUND_UP(radio_tx_airtime_ns, 1000);
+	uint32_t period_us = MAX(airtime_us * 100 / CLAMP(duty_cycle, 1, 100),
+							 airtime_us + RADIO_TX_TURNAROUND_US);
 
-	nrfx_gppi_channels_disable(BIT(ppi_radio_start));
-	// nrfx_gppi_event_endpoint_clear(ppi_radio_start,
-	// 							   nrf_egu_event_address_get(RADIO_TEST_EGU, RADIO_TEST_EGU_EVENT));
-	nrfx_gppi_task_endpoint_clear(ppi_radio_start,
-								  nrf_radio_task_address_get(NRF_RADIO, NRF_RADIO_TASK_TXEN));
-	nrfx_gppi_task_endpoint_clear(ppi_radio_start,
-								  nrf_radio_task_address_get(NRF_RADIO, NRF_RADIO_TASK_RXEN));
-	nrfx_gppi_fork_endpoint_clear(ppi_radio_start,
-								  nrf_timer_task_address_get(timer.p_reg, NRF_TIMER_TASK_START));
-	nrfx_gppi_event_endpoint_clear(ppi_radio_start,
-								   nrf_timer_event_address_get(timer.p_reg, NRF_TIMER_EVENT_COMPARE1));
+	printk("radio_modulated_tx_duty_cycle: %u ns on air every %u us\n", radio_tx_airtime_ns, period_us);
 
-	radio_disable();
+	nrf_timer_cc_set(timer.p_reg, NRF_TIMER_CC_CHANNEL1, period_us);
+
+	nrfx_gppi_channel_endpoints_setup(ppi_tx_end,
+									  nrf_radio_event_address_get(NRF_RADIO, long_range ? NRF_RADIO_EVENT_PHYEND
+																						: NRF_RADIO_EVENT_END),
+									  nrf_timer_task_address_get(RADIO_TX_COUNTER, NRF_TIMER_TASK_COUNT));
+	nrfx_gppi_channel_endpoints_setup(ppi_radio_start,
+									  nrf_timer_event_address_get(timer.p_reg, NRF_TIMER_EVENT_COMPARE1),
+									  nrf_radio_task_address_get(NRF_RADIO, NRF_RADIO_TASK_TXEN));
+	nrfx_gppi_channels_enable(BIT(ppi_tx_end) | BIT(ppi_radio_start));
+
+	tx_duty_cycle_start_ms = k_uptime_get();
+	tx_duty_cycle_active = true;
+
+	/* The first packet now, COMPARE1 sends the next ones */
+	nrf_timer_task_trigger(timer.p_reg, NRF_TIMER_TASK_START);
+	nrf_radio_task_trigger(NRF_RADIO, NRF_RADIO_TASK_TXEN);
 }
 
-void radio_rx_stats_get(struct radio_rx_stats *rx_stats)
+/* The END interrupt is off while sending with a duty cycle, take the
+ * packet count from RADIO_TX_COUNTER
+ */
+static void radio_tx_duty_cycle_stop(void)
 {
-	size_t size;
-	size = sizeof(rx_packet);
-	rx_stats->last_packet.buf = rx_packet;
-	rx_stats->last_packet.len = size;
-	rx_stats->packet_cnt = rx_packet_cnt;
+	nrfx_gppi_channels_disable(BIT(ppi_radio_start) | BIT(ppi_tx_end));
+
+	radio_packets_sent = tx_counter_stop();
+
+	int64_t elapsed_ms = k_uptime_get() - tx_duty_cycle_start_ms;
+
+	radio_tx_duty_cycle_ppm =
+		elapsed_ms > 0 ? (uint64_t)radio_packets_sent * radio_tx_airtime_ns / elapsed_ms : 0;
+	printk("radio_tx_duty_cycle_stop: %u packets, %u ppm on air\n", radio_packets_sent,
+		   radio_tx_duty_cycle_ppm);
+
+	nrfx_gppi_event_endpoint_clear(ppi_tx_end,
+								   nrf_radio_event_address_get(NRF_RADIO, NRF_RADIO_EVENT_END));
+	nrfx_gppi_event_endpoint_clear(ppi_tx_end,
+								   nrf_radio_event_address_get(NRF_RADIO, NRF_RADIO_EVENT_PHYEND));
+	nrfx_gppi_task_endpoint_clear(ppi_tx_end,
+								  nrf_timer_task_address_get(RADIO_TX_COUNTER, NRF_TIMER_TASK_COUNT));
+
+	tx_duty_cycle_active = false;
 }
 
-static uint16_t write_rx_stats_to_buf()
+/* Sends packets back to back for as long as the test runs. The turnaround
+ * is the END_START (PHYEND_START) short radio_modulated_tx_config() sets
+ * up for every modulated TX, already the tightest the radio has; this test
+ * only takes the CPU out of the loop. The payload is filled once up front
+ * instead of on every ADDRESS, and packets are counted and timed over PPI
+ * with every interrupt off.
+ */
+static void radio_modulated_tx_throughput(uint8_t mode, int8_t txpower, uint8_t channel,
+										  enum transmit_pattern pattern)
 {
-	rx_log_buf[0] = radio_total_rssi & 0xFF;
-	rx_log_buf[1] = (radio_total_rssi >> 8) & 0xFF;
-	rx_log_buf[2] = (radio_total_rssi >> 16) & 0xFF;
-	rx_log_buf[3] = (radio_total_rssi >> 24) & 0xFF;
+	bool long_range = mode == RADIO_MODE_MODE_Ble_LR125Kbit || mode == RADIO_MODE_MODE_Ble_LR500Kbit;
+	uint32_t end = nrf_radio_event_address_get(NRF_RADIO, long_range ? NRF_RADIO_EVENT_PHYEND
+																	 : NRF_RADIO_EVENT_END);
 
-	rx_log_buf[4] = radio_packets_received & 0xFF;
-	rx_log_buf[5] = (radio_packets_received >> 8) & 0xFF;
-	rx_log_buf[6] = (radio_packets_received >> 16) & 0xFF;
-	rx_log_buf[7] = (radio_packets_received >> 24) & 0xFF;
+	radio_modulated_tx_config(mode, txpower, channel, pattern);
 
-	rx_log_buf[8] = radio_total_crcok & 0xFF;
-	rx_log_buf[9] = (radio_total_crcok >> 8) & 0xFF;
-	rx_log_buf[10] = (radio_total_crcok >> 16) & 0xFF;
-	rx_log_buf[11] = (radio_total_crcok >> 24) & 0xFF;
+	/* Every packet carries the payload filled by the config */
+	tx_refill = false;
+	nrf_radio_int_disable(NRF_RADIO, ~0);
 
-	uint32_t ticks = NRF_TIMER2->CC[1];
+	tx_counter_start();
 
-	rx_log_buf[12] = ticks & 0xFF;
-	rx_log_buf[13] = (ticks >> 8) & 0xFF;
-	rx_log_buf[14] = (ticks >> 16) & 0xFF;
-	rx_log_buf[15] = (ticks >> 24) & 0xFF;
+	nrf_timer_task_trigger(RADIO_TX_PERIOD_TIMER, NRF_TIMER_TASK_STOP);
+	nrf_timer_mode_set(RADIO_TX_PERIOD_TIMER, NRF_TIMER_MODE_TIMER);
+	nrf_timer_bit_width_set(RADIO_TX_PERIOD_TIMER, NRF_TIMER_BIT_WIDTH_32);
+	nrf_timer_frequency_set(RADIO_TX_PERIOD_TIMER, NRF_TIMER_FREQ_16MHz);
+	nrf_timer_task_trigger(RADIO_TX_PERIOD_TIMER, NRF_TIMER_TASK_CLEAR);
 
-	rx_log_buf[16] = rssi;
-	rx_log_buf[17] = packet_size;
+	nrfx_gppi_channel_endpoints_setup(ppi_tx_end, end,
+									  nrf_timer_task_address_get(RADIO_TX_COUNTER, NRF_TIMER_TASK_COUNT));
+	nrfx_gppi_channel_endpoints_setup(ppi_tx_period, end,
+									  nrf_timer_task_address_get(RADIO_TX_PERIOD_TIMER, NRF_TIMER_TASK_CAPTURE0));
+	nrfx_gppi_fork_endpoint_setup(ppi_tx_period,
+								  nrf_timer_task_address_get(RADIO_TX_PERIOD_TIMER, NRF_TIMER_TASK_START));
+	nrfx_gppi_channels_enable(BIT(ppi_tx_end) | BIT(ppi_tx_period));
 
-	memcpy(rx_log_buf + 18, rx_packet, packet_size);
+	radio_tx_period_ns = 0;
+	tx_throughput_active = true;
 
-	return 18 + packet_size;
+	nrf_radio_task_trigger(NRF_RADIO, NRF_RADIO_TASK_TXEN);
 }
 
-static void write_rx_log_thread(void)
+/* The first end of packet started the period timer and the last one
+ * captured it, which spans one packet less than were counted
+ */
+static void radio_tx_throughput_stop(void)
 {
-	while (true)
+	nrfx_gppi_channels_disable(BIT(ppi_tx_end) | BIT(ppi_tx_period));
+
+	radio_packets_sent = tx_counter_stop();
+	nrf_timer_task_trigger(RADIO_TX_PERIOD_TIMER, NRF_TIMER_TASK_STOP);
+
+	if (radio_packets_sent > 1)
 	{
-		if (radio_logging_active)
-		{
-			uint16_t rx_stats_bytes = write_rx_stats_to_buf();
+		uint64_t ticks = nrf_timer_cc_get(RADIO_TX_PERIOD_TIMER, NRF_TIMER_CC_CHANNEL0);
 
-			printk("write_rx_log_thread: writing\n");
-			int err = fs_write_packet(fs_flash_device, rx_log_buf, rx_stats_bytes);
+		radio_tx_period_ns = ticks * 1000 / 16 / (radio_packets_sent - 1);
+	}
+
+	uint32_t airtime_ns = radio_airtime_ns(radio_packet_len);
+
+	printk("radio_tx_throughput_stop: %u packets, every %u ns for %u ns on air, %u ns apart\n",
+		   radio_packets_sent, radio_tx_period_ns, airtime_ns,
+		   radio_tx_period_ns > airtime_ns ? radio_tx_period_ns - airtime_ns : 0);
+
+	nrfx_gppi_fork_endpoint_clear(ppi_tx_period,
+								  nrf_timer_task_address_get(RADIO_TX_PERIOD_TIMER, NRF_TIMER_TASK_START));
+
+	tx_throughput_active = false;
+}
+
+/* Round trip times in us land in bins 0 to 7 as they are, from there on
+ * every power of two is split in 8
+ */
+static uint8_t rtt_bin(uint32_t us)
+{
+	if (us < RADIO_RTT_SUB_BINS)
+	{
+		return us;
+	}
+
+	uint32_t e = 31 - __builtin_clz(us);
+
+	return MIN((e - 2) * RADIO_RTT_SUB_BINS + ((us >> (e - 3)) & (RADIO_RTT_SUB_BINS - 1)),
+			   RADIO_RTT_BINS - 1);
+}
+
+/* Middle of a bin, in us */
+static uint32_t rtt_bin_value(uint8_t bin)
+{
+	if (bin < RADIO_RTT_SUB_BINS)
+	{
+		return bin;
+	}
+
+	uint32_t e = bin / RADIO_RTT_SUB_BINS + 2;
+	uint32_t width = 1 << (e - 3);
+
+	return (RADIO_RTT_SUB_BINS + bin % RADIO_RTT_SUB_BINS) * width + (width - 1) / 2;
+}
+
+static void rtt_record(struct radio_rtt_stats *stats, uint32_t us)
+{
+	stats->exchanges++;
+	stats->min = MIN(stats->min, us);
+	stats->max = MAX(stats->max, us);
+	stats->sum += us;
+	stats->hist[rtt_bin(us)]++;
+}
+
+static bool ping_echoed(void)
+{
+	if (!nrf_radio_event_check(NRF_RADIO, NRF_RADIO_EVENT_END) || !nrf_radio_crc_status_check(NRF_RADIO))
+	{
+		return false;
+	}
+
+	/* Pings too short for a sequence number take any echo */
+	return ping_packet[0] < RADIO_SEQ_HEADER_LEN || get_u32(ping_packet + 1) == ping_seq;
+}
+
+static void ping_send(void)
+{
+	radio_payload_fill(ping_packet);
+	tx_sequence_stamp(ping_packet, ping_seq);
+
+	nrf_radio_packetptr_set(NRF_RADIO, ping_packet);
+	nrf_timer_task_trigger(RADIO_RTT_TIMER, NRF_TIMER_TASK_STOP);
+	nrf_timer_task_trigger(RADIO_RTT_TIMER, NRF_TIMER_TASK_CLEAR);
+
+	nrf_radio_shorts_enable(NRF_RADIO, NRF_RADIO_SHORT_DISABLED_RXEN_MASK);
+	nrf_radio_task_trigger(NRF_RADIO, NRF_RADIO_TASK_TXEN);
+}
+
+/* Sets up either end of a ping-pong, the radio still has to be enabled */
+static void radio_ping_pong_config(uint8_t mode, int8_t txpower, uint8_t channel)
+{
+	bool long_range = mode == RADIO_MODE_MODE_Ble_LR125Kbit || mode == RADIO_MODE_MODE_Ble_LR500Kbit;
+
+	if (ppi_set_rx.allocated)
+	{
+		nrfx_gppi_channels_disable(BIT(ppi_rx_timestamp));
+	}
+	radio_disable();
+	radio_config(mode);
+	radio_power_set(mode, channel, txpower);
+	radio_channel_set(mode, channel);
+	current_channel = channel;
+
+	radio_pattern = TRANSMIT_PATTERN_11110000;
+	radio_receiving = false;
+	nrf_radio_packetptr_set(NRF_RADIO, ping_packet);
+
+	nrf_radio_shorts_set(NRF_RADIO,
+						 NRF_RADIO_SHORT_READY_START_MASK |
+							 (long_range ? NRF_RADIO_SHORT_PHYEND_DISABLE_MASK
+										 : NRF_RADIO_SHORT_END_DISABLE_MASK));
+
+	nrf_radio_event_clear(NRF_RADIO, NRF_RADIO_EVENT_DISABLED);
+	nrf_radio_int_enable(NRF_RADIO, NRF_RADIO_INT_DISABLED_MASK);
+}
+
+/* Arms RADIO_RTT_TIMER for every exchange started by TXEN, the radio is
+ * disabled if nothing is received `timeout_us` after TXREADY
+ */
+static void rtt_timer_setup(uint32_t timeout_us)
+{
+	nrf_timer_task_trigger(RADIO_RTT_TIMER, NRF_TIMER_TASK_STOP);
+	nrf_timer_mode_set(RADIO_RTT_TIMER, NRF_TIMER_MODE_TIMER);
+	nrf_timer_bit_width_set(RADIO_RTT_TIMER, NRF_TIMER_BIT_WIDTH_32);
+	nrf_timer_frequency_set(RADIO_RTT_TIMER, NRF_TIMER_FREQ_1MHz);
+	nrf_timer_cc_set(RADIO_RTT_TIMER, NRF_TIMER_CC_CHANNEL0, timeout_us);
+	nrf_timer_shorts_set(RADIO_RTT_TIMER, NRF_TIMER_SHORT_COMPARE0_STOP_MASK);
+
+	nrfx_gppi_channel_endpoints_setup(ppi_rtt_start,
+									  nrf_radio_event_address_get(NRF_RADIO, NRF_RADIO_EVENT_TXREADY),
+									  nrf_timer_task_address_get(RADIO_RTT_TIMER, NRF_TIMER_TASK_CLEAR));
+	nrfx_gppi_fork_endpoint_setup(ppi_rtt_start,
+								  nrf_timer_task_address_get(RADIO_RTT_TIMER, NRF_TIMER_TASK_START));
+	nrfx_gppi_channel_endpoints_setup(ppi_rtt_capture,
+									  nrf_radio_event_address_get(NRF_RADIO, NRF_RADIO_EVENT_ADDRESS),
+									  nrf_timer_task_address_get(RADIO_RTT_TIMER, NRF_TIMER_TASK_CAPTURE1));
+	nrfx_gppi_channel_endpoints_setup(ppi_rtt_timeout,
+									  nrf_timer_event_address_get(RADIO_RTT_TIMER, NRF_TIMER_EVENT_COMPARE0),
+									  nrf_radio_task_address_get(NRF_RADIO, NRF_RADIO_TASK_DISABLE));
+	nrfx_gppi_channels_enable(BIT(ppi_rtt_start) | BIT(ppi_rtt_capture) | BIT(ppi_rtt_timeout));
+}
+
+/* Sends `packets_num` pings, or until cancelled for 0, and calls `cb` after
+ * the last exchange
+ */
+static void radio_ping(uint8_t mode, int8_t txpower, uint8_t channel, uint32_t packets_num,
+					   void (*cb)(void))
+{
+	radio_ping_pong_config(mode, txpower, channel);
+
+	struct radio_rtt_stats *stats = &rtt_stats[radio_profile->phy];
+
+	memset(stats, 0, sizeof(*stats));
+	stats->min = UINT32_MAX;
+
+	rtt_timer_setup(2 * radio_airtime_ns(radio_packet_len) / 1000 + RADIO_RTT_MARGIN_US);
+
+	ping_seq = 0;
+	ping_count = packets_num;
+	tx_done_cb = cb;
+	ping_active = true;
+
+	ping_send();
+}
+
+/* Echoes every packet received until cancelled */
+static void radio_pong(uint8_t mode, int8_t txpower, uint8_t channel)
+{
+	radio_ping_pong_config(mode, txpower, channel);
+
+	nrf_radio_shorts_enable(NRF_RADIO, NRF_RADIO_SHORT_DISABLED_TXEN_MASK);
+	pong_active = true;
+
+	nrf_radio_task_trigger(NRF_RADIO, NRF_RADIO_TASK_RXEN);
+}
+
+static void radio_ping_pong_stop(void)
+{
+	if (ppi_set_rtt.allocated)
+	{
+		nrfx_gppi_channels_disable(BIT(ppi_rtt_start) | BIT(ppi_rtt_capture) | BIT(ppi_rtt_timeout));
+		nrfx_gppi_fork_endpoint_clear(ppi_rtt_start,
+									  nrf_timer_task_address_get(RADIO_RTT_TIMER, NRF_TIMER_TASK_START));
+	}
+
+	nrf_timer_task_trigger(RADIO_RTT_TIMER, NRF_TIMER_TASK_STOP);
+	nrf_timer_shorts_set(RADIO_RTT_TIMER, 0);
+
+	ping_active = false;
+	pong_active = false;
+}
+
+static bool radio_state_tx(void)
+{
+	nrf_radio_state_t state = nrf_radio_state_get(NRF_RADIO);
+
+	return state == NRF_RADIO_STATE_TXRU || state == NRF_RADIO_STATE_TXIDLE || state == NRF_RADIO_STATE_TX;
+}
+
+/* The ping is out and the radio on its way to RX, or the echo is in or
+ * timed out and the radio stays disabled
+ */
+static inline void ping_disabled(void)
+{
+	if (nrf_radio_state_get(NRF_RADIO) != NRF_RADIO_STATE_DISABLED)
+	{
+		nrf_radio_shorts_disable(NRF_RADIO, NRF_RADIO_SHORT_DISABLED_RXEN_MASK);
+		nrf_radio_event_clear(NRF_RADIO, NRF_RADIO_EVENT_END);
+		return;
+	}
+
+	nrf_timer_task_trigger(RADIO_RTT_TIMER, NRF_TIMER_TASK_STOP);
+
+	struct radio_rtt_stats *stats = &rtt_stats[radio_profile->phy];
+
+	if (ping_echoed())
+	{
+		rtt_record(stats, nrf_timer_cc_get(RADIO_RTT_TIMER, NRF_TIMER_CC_CHANNEL1));
+		radio_is_active_counter = 1000;
+	}
+	else
+	{
+		stats->lost++;
+	}
+
+	radio_packets_sent = ++ping_seq;
+	if (ping_count > 0 && ping_seq >= ping_count)
+	{
+		nrf_radio_int_disable(NRF_RADIO, NRF_RADIO_INT_DISABLED_MASK);
+		ping_active = false;
+		tx_elapsed_stop();
+		if (tx_done_cb)
+		{
+			tx_done_cb();
+		}
+		return;
+	}
+
+	ping_send();
+}
+
+/* Turns the responder round for whichever way the radio is now going */
+static inline void pong_disabled(void)
+{
+	if (radio_state_tx())
+	{
+		nrf_radio_shorts_disable(NRF_RADIO, NRF_RADIO_SHORT_DISABLED_TXEN_MASK);
+		nrf_radio_shorts_enable(NRF_RADIO, NRF_RADIO_SHORT_DISABLED_RXEN_MASK);
+		radio_packets_sent++;
+		radio_is_active_counter = 1000;
+	}
+	else
+	{
+		nrf_radio_shorts_disable(NRF_RADIO, NRF_RADIO_SHORT_DISABLED_RXEN_MASK);
+		nrf_radio_shorts_enable(NRF_RADIO, NRF_RADIO_SHORT_DISABLED_TXEN_MASK);
+	}
+}
+
+static bool ack_received(void)
+{
+	if (!nrf_radio_event_check(NRF_RADIO, NRF_RADIO_EVENT_END) || !nrf_radio_crc_status_check(NRF_RADIO))
+	{
+		return false;
+	}
+
+	/* Frames too short for a sequence number take any ACK */
+	return radio_packet_len < RADIO_SEQ_HEADER_LEN || get_u32(ping_packet + 1) == ack_seq;
+}
+
+/* Sends the current frame again, or the next one after ack_attempt = 0. The
+ * last ACK was received over the frame, so it is filled in again.
+ */
+static void ack_frame_send(void)
+{
+	radio_payload_fill(ping_packet);
+	tx_sequence_stamp(ping_packet, ack_seq);
+	ack_attempt++;
+	ack_stats.attempts++;
+	radio_packets_sent++;
+
+	nrf_radio_packetptr_set(NRF_RADIO, ping_packet);
+	nrf_timer_task_trigger(RADIO_RTT_TIMER, NRF_TIMER_TASK_STOP);
+	nrf_timer_task_trigger(RADIO_RTT_TIMER, NRF_TIMER_TASK_CLEAR);
+
+	nrf_radio_shorts_enable(NRF_RADIO, NRF_RADIO_SHORT_DISABLED_RXEN_MASK);
+	nrf_radio_task_trigger(NRF_RADIO, NRF_RADIO_TASK_TXEN);
+}
+
+/* Sends `packets_num` frames, or until cancelled for 0, each up to `retries`
+ * times more until it is acknowledged, and calls `cb` after the last
+ */
+static void radio_ack_tx(uint8_t mode, int8_t txpower, uint8_t channel, uint32_t packets_num,
+						 uint8_t retries, void (*cb)(void))
+{
+	radio_ping_pong_config(mode, txpower, channel);
+
+	memset(&ack_stats, 0, sizeof(ack_stats));
+	radio_frames_delivered = 0;
+
+	/* The ACK's airtime is its header, sequence number and CRC */
+	rtt_timer_setup((radio_airtime_ns(radio_packet_len) +
+					 radio_airtime_ns(RADIO_ACK_PAYLOAD_LEN + radio_profile->crc_in_length)) /
+						1000 +
+					RADIO_RTT_MARGIN_US);
+
+	ack_retries = MIN(retries, RADIO_ACK_ATTEMPT_BINS - 1);
+	ack_attempt = 0;
+	ack_seq = 0;
+	ack_count = packets_num;
+	tx_done_cb = cb;
+	ack_tx_active = true;
+
+	ack_frame_send();
+}
+
+/* Acknowledges every intact frame received until cancelled */
+static void radio_ack_rx(uint8_t mode, int8_t txpower, uint8_t channel)
+{
+	radio_ping_pong_config(mode, txpower, channel);
+
+	memset(&ack_stats, 0, sizeof(ack_stats));
+	ack_have_last = false;
+	ack_sending = false;
+	ack_packet[0] = RADIO_ACK_PAYLOAD_LEN + radio_profile->crc_in_length;
+
+	nrfx_gppi_channel_endpoints_setup(ppi_ack_arm,
+									  nrf_radio_event_address_get(NRF_RADIO, NRF_RADIO_EVENT_CRCOK),
+									  nrfx_gppi_task_address_get(nrfx_gppi_group_enable_task_get(ack_group)));
+	nrfx_gppi_channel_endpoints_setup(ppi_ack_send,
+									  nrf_egu_event_address_get(RADIO_TEST_EGU, RADIO_ACK_EGU_EVENT),
+									  nrf_radio_task_address_get(NRF_RADIO, NRF_RADIO_TASK_TXEN));
+	nrfx_gppi_fork_endpoint_setup(ppi_ack_send,
+								  nrfx_gppi_task_address_get(nrfx_gppi_group_disable_task_get(ack_group)));
+	nrfx_gppi_channels_group_set(BIT(ppi_ack_send), ack_group);
+	nrfx_gppi_group_disable(ack_group);
+	nrfx_gppi_channels_enable(BIT(ppi_ack_arm));
+
+	nrf_radio_event_clear(NRF_RADIO, NRF_RADIO_EVENT_END);
+	nrf_radio_int_enable(NRF_RADIO, NRF_RADIO_INT_END_MASK);
+
+	ack_rx_active = true;
+
+	nrf_radio_task_trigger(NRF_RADIO, NRF_RADIO_TASK_RXEN);
+}
+
+static void radio_ack_stop(void)
+{
+	if (ppi_set_ack.allocated)
+	{
+		nrfx_gppi_channels_disable(BIT(ppi_ack_arm));
+		nrfx_gppi_group_disable(ack_group);
+		nrfx_gppi_channels_remove_from_group(BIT(ppi_ack_send), ack_group);
+		nrfx_gppi_fork_endpoint_clear(ppi_ack_send,
+									  nrfx_gppi_task_address_get(nrfx_gppi_group_disable_task_get(ack_group)));
+	}
+	if (ack_rx_active)
+	{
+		nrf_radio_int_disable(NRF_RADIO, NRF_RADIO_INT_END_MASK);
+	}
+
+	ack_tx_active = false;
+	ack_rx_active = false;
+}
+
+/* The receiver's frame is in, CRCOK armed ack_group if it is intact */
+static inline void ack_frame_end(void)
+{
+	if (ack_sending)
+	{
+		return;
+	}
+
+	ack_stats.attempts++;
+	if (!nrf_radio_crc_status_check(NRF_RADIO))
+	{
+		return;
+	}
+	radio_is_active_counter = 1000;
+
+	uint32_t seq = get_u32(ping_packet + 1);
+
+	if (ping_packet[0] >= RADIO_SEQ_HEADER_LEN && ack_have_last && seq == ack_last_seq)
+	{
+		ack_stats.duplicates++;
+	}
+	else
+	{
+		ack_stats.delivered++;
+	}
+	ack_last_seq = seq;
+	ack_have_last = true;
+}
+
+/* The frame is out and the radio on its way to RX, or the ACK is in or
+ * timed out and the frame is sent again or the next one
+ */
+static inline void ack_tx_disabled(void)
+{
+	if (nrf_radio_state_get(NRF_RADIO) != NRF_RADIO_STATE_DISABLED)
+	{
+		nrf_radio_shorts_disable(NRF_RADIO, NRF_RADIO_SHORT_DISABLED_RXEN_MASK);
+		nrf_radio_event_clear(NRF_RADIO, NRF_RADIO_EVENT_END);
+		return;
+	}
+
+	nrf_timer_task_trigger(RADIO_RTT_TIMER, NRF_TIMER_TASK_STOP);
+
+	if (ack_received())
+	{
+		ack_stats.hist[ack_attempt - 1]++;
+		radio_frames_delivered = ++ack_stats.delivered;
+		radio_is_active_counter = 1000;
+	}
+	else if (ack_attempt <= ack_retries)
+	{
+		ack_frame_send();
+		return;
+	}
+	else
+	{
+		ack_stats.failed++;
+	}
+
+	ack_seq++;
+	ack_attempt = 0;
+	if (ack_count > 0 && ack_seq >= ack_count)
+	{
+		nrf_radio_int_disable(NRF_RADIO, NRF_RADIO_INT_DISABLED_MASK);
+		ack_tx_active = false;
+		tx_elapsed_stop();
+		if (tx_done_cb)
+		{
+			tx_done_cb();
+		}
+		return;
+	}
+
+	ack_frame_send();
+}
+
+/* An intact frame is in and gets its ACK, or the ACK is out or the frame
+ * failed its CRC and the radio receives the next frame
+ */
+static inline void ack_rx_disabled(void)
+{
+	if (!ack_sending && nrf_radio_crc_status_check(NRF_RADIO))
+	{
+		/* Written before the EGU lets ack_group start the ramp up */
+		put_u32(ack_packet + 1, get_u32(ping_packet + 1));
+		nrf_radio_packetptr_set(NRF_RADIO, ack_packet);
+
+		ack_sending = true;
+		ack_stats.acks++;
+		radio_packets_sent++;
+		nrf_egu_event_clear(RADIO_TEST_EGU, RADIO_ACK_EGU_EVENT);
+		nrf_egu_task_trigger(RADIO_TEST_EGU, RADIO_ACK_EGU_TASK);
+		return;
+	}
+
+	ack_sending = false;
+	nrf_radio_packetptr_set(NRF_RADIO, ping_packet);
+	nrf_radio_task_trigger(NRF_RADIO, NRF_RADIO_TASK_RXEN);
+}
+
+/* Points PACKETPTR at the buffer for the next packet before RXEN. The READY
+ * interrupt queues the one after it once READY_START has taken the pointer,
+ * from then on the END interrupt keeps PACKETPTR ahead.
+ */
+static void rx_dma_start(void)
+{
+	nrf_radio_packetptr_set(NRF_RADIO, rx_packets[rx_done_count % RX_PACKET_BUFS]);
+
+	nrf_radio_event_clear(NRF_RADIO, NRF_RADIO_EVENT_READY);
+	nrf_radio_int_enable(NRF_RADIO, NRF_RADIO_INT_READY_MASK);
+}
+
+static void radio_rx(uint8_t mode, uint8_t channel, enum transmit_pattern pattern)
+{
+	radio_disable();
+
+	nrf_radio_shorts_enable(NRF_RADIO,
+							NRF_RADIO_SHORT_READY_START_MASK |
+								NRF_RADIO_SHORT_END_START_MASK |
+								NRF_RADIO_SHORT_ADDRESS_RSSISTART_MASK |
+								NRF_RADIO_SHORT_DISABLED_RSSISTOP_MASK);
+	rx_done_count = 0;
+	rx_packet = rx_packets[RX_PACKET_BUFS - 1];
+
+	radio_config(mode);
+
+	/* PRBS payloads are expected from what each packet syncs to */
+	radio_pattern = pattern;
+	radio_payload_fill(rx_expected);
+	radio_channel_set(mode, channel);
+
+	rx_packet_cnt = 0;
+	radio_receiving = true;
+
+	/* Timestamp in hardware, free of interrupt latency */
+	nrfx_gppi_channel_endpoints_setup(ppi_rx_timestamp,
+									  nrf_radio_event_address_get(NRF_RADIO, NRF_RADIO_EVENT_ADDRESS),
+									  nrf_timer_task_address_get(NRF_TIMER2, NRF_TIMER_TASK_CAPTURE1));
+	nrfx_gppi_channels_enable(BIT(ppi_rx_timestamp));
+
+	/* One interrupt per packet */
+	nrf_radio_event_clear(NRF_RADIO, NRF_RADIO_EVENT_END);
+	nrf_radio_int_enable(NRF_RADIO, NRF_RADIO_INT_END_MASK);
+
+	current_channel = channel;
+
+	rx_dma_start();
+	nrf_radio_task_trigger(NRF_RADIO, NRF_RADIO_TASK_RXEN);
+}
+
+/* Hops to the next channel every `delay_ms`: TIMER0 COMPARE0 disables the
+ * radio over PPI and the DISABLED interrupt retunes and enables it again.
+ * The radio must already be set up for the first channel.
+ */
+static void radio_sweep_start(uint8_t channel_start, uint8_t channel_end, uint32_t delay_ms)
+{
+	sweep_channel_start = channel_start;
+	sweep_channel_end = channel_end;
+	sweep_active = true;
+
+	/* TIMER0 is MPSL's while BT runs, set it up from scratch */
+	nrf_timer_task_trigger(timer.p_reg, NRF_TIMER_TASK_STOP);
+	nrf_timer_mode_set(timer.p_reg, NRF_TIMER_MODE_TIMER);
+	nrf_timer_bit_width_set(timer.p_reg, NRF_TIMER_BIT_WIDTH_32);
+	nrf_timer_frequency_set(timer.p_reg, NRF_TIMER_FREQ_1MHz);
+	nrf_timer_int_disable(timer.p_reg, ~0);
+	nrf_timer_cc_set(timer.p_reg, NRF_TIMER_CC_CHANNEL0, delay_ms * 1000);
+	nrf_timer_shorts_set(timer.p_reg, NRF_TIMER_SHORT_COMPARE0_CLEAR_MASK);
+	nrf_timer_task_trigger(timer.p_reg, NRF_TIMER_TASK_CLEAR);
+
+	nrfx_gppi_channel_endpoints_setup(ppi_radio_disable,
+									  nrf_timer_event_address_get(timer.p_reg, NRF_TIMER_EVENT_COMPARE0),
+									  nrf_radio_task_address_get(NRF_RADIO, NRF_RADIO_TASK_DISABLE));
+	nrfx_gppi_channels_enable(BIT(ppi_radio_disable));
+
+	nrf_radio_event_clear(NRF_RADIO, NRF_RADIO_EVENT_DISABLED);
+	nrf_radio_int_enable(NRF_RADIO, NRF_RADIO_INT_DISABLED_MASK);
+
+	nrf_timer_task_trigger(timer.p_reg, NRF_TIMER_TASK_START);
+}
+
+static int radio_ppi_set_alloc(struct radio_ppi_set *set)
+{
+	size_t channels = 0;
+	size_t groups = 0;
+
+	if (set->allocated)
+	{
+		return 0;
+	}
+
+	for (; channels < RADIO_PPI_SET_CHANNELS && set->channels[channels]; channels++)
+	{
+		if (nrfx_gppi_channel_alloc(set->channels[channels]) != NRFX_SUCCESS)
+		{
+			goto error;
+		}
+	}
+	for (; groups < RADIO_PPI_SET_GROUPS && set->groups[groups]; groups++)
+	{
+		if (nrfx_gppi_group_alloc(set->groups[groups]) != NRFX_SUCCESS)
+		{
+			goto error;
+		}
+	}
+
+	set->allocated = true;
+	return 0;
+
+error:
+	while (groups--)
+	{
+		nrfx_gppi_group_free(*set->groups[groups]);
+	}
+	while (channels--)
+	{
+		nrfx_gppi_channel_free(*set->channels[channels]);
+	}
+	return -ENOMEM;
+}
+
+/* Allocates the PPI channels the test needs, if not done yet */
+static int radio_ppi_alloc(const struct radio_test_config *config)
+{
+	int err = 0;
+
+	switch (config->type)
+	{
+	case MODULATED_TX:
+		if (config->params.modulated_tx.packets_num > 0)
+		{
+			err = radio_ppi_set_alloc(&ppi_set_tx_end);
+			if (!err)
+			{
+				err = radio_ppi_set_alloc(&ppi_set_tx_count);
+			}
+		}
+		break;
+	case RX:
+		err = radio_ppi_set_alloc(&ppi_set_rx);
+		break;
+	case TX_SWEEP:
+		err = radio_ppi_set_alloc(&ppi_set_sweep);
+		break;
+	case RX_SWEEP:
+		err = radio_ppi_set_alloc(&ppi_set_rx);
+		if (!err)
+		{
+			err = radio_ppi_set_alloc(&ppi_set_sweep);
+		}
+		break;
+	case TX_THROUGHPUT:
+		err = radio_ppi_set_alloc(&ppi_set_tx_end);
+		if (!err)
+		{
+			err = radio_ppi_set_alloc(&ppi_set_throughput);
+		}
+		break;
+	case PING:
+	case ACK_TX:
+		err = radio_ppi_set_alloc(&ppi_set_rtt);
+		break;
+	case ACK_RX:
+		err = radio_ppi_set_alloc(&ppi_set_ack);
+		break;
+	case MODULATED_TX_DUTY_CYCLE:
+		err = radio_ppi_set_alloc(&ppi_set_tx_end);
+		if (!err)
+		{
+			err = radio_ppi_set_alloc(&ppi_set_duty_cycle);
+		}
+		break;
+	default:
+		break;
+	}
+
+	return err;
+}
+
+int radio_test_start(const struct radio_test_config *config)
+{
+	int err = radio_ppi_alloc(config);
+	if (err)
+	{
+		printk("radio_test_start: could not allocate PPI channels\n");
+		return err;
+	}
+
+	switch (config->type)
+	{
+	case MODULATED_TX:
+		tx_elapsed_start();
+		if (config->params.modulated_tx.packets_num > 0)
+		{
+			radio_modulated_tx_count(config->mode,
+									 config->params.modulated_tx.txpower,
+									 config->params.modulated_tx.channel,
+									 config->params.modulated_tx.pattern,
+									 config->params.modulated_tx.packets_num,
+									 config->params.modulated_tx.cb);
+		}
+		else
+		{
+			radio_modulated_tx_carrier(config->mode,
+									   config->params.modulated_tx.txpower,
+									   config->params.modulated_tx.channel,
+									   config->params.modulated_tx.pattern);
+		}
+		break;
+	case RX:
+		radio_rx(config->mode,
+				 config->params.rx.channel,
+				 config->params.rx.pattern);
+		break;
+	case TX_SWEEP:
+		tx_elapsed_start();
+		radio_modulated_tx_carrier(config->mode,
+								   config->params.tx_sweep.txpower,
+								   config->params.tx_sweep.channel_start,
+								   TRANSMIT_PATTERN_11110000);
+		radio_sweep_start(config->params.tx_sweep.channel_start,
+						  config->params.tx_sweep.channel_end,
+						  config->params.tx_sweep.delay_ms);
+		break;
+	case RX_SWEEP:
+		radio_rx(config->mode,
+				 config->params.rx_sweep.channel_start,
+				 TRANSMIT_PATTERN_11110000);
+		radio_sweep_start(config->params.rx_sweep.channel_start,
+						  config->params.rx_sweep.channel_end,
+						  config->params.rx_sweep.delay_ms);
+		break;
+	case TX_THROUGHPUT:
+		tx_elapsed_start();
+		radio_modulated_tx_throughput(config->mode,
+									  config->params.modulated_tx.txpower,
+									  config->params.modulated_tx.channel,
+									  config->params.modulated_tx.pattern);
+		break;
+	case PING:
+		tx_elapsed_start();
+		radio_ping(config->mode,
+				   config->params.modulated_tx.txpower,
+				   config->params.modulated_tx.channel,
+				   config->params.modulated_tx.packets_num,
+				   config->params.modulated_tx.cb);
+		break;
+	case PONG:
+		radio_pong(config->mode,
+				   config->params.modulated_tx.txpower,
+				   config->params.modulated_tx.channel);
+		break;
+	case ACK_TX:
+		tx_elapsed_start();
+		radio_ack_tx(config->mode,
+					 config->params.ack.txpower,
+					 config->params.ack.channel,
+					 config->params.ack.packets_num,
+					 config->params.ack.retries,
+					 config->params.ack.cb);
+		break;
+	case ACK_RX:
+		radio_ack_rx(config->mode,
+					 config->params.ack.txpower,
+					 config->params.ack.channel);
+		break;
+	case MODULATED_TX_DUTY_CYCLE:
+		tx_elapsed_start();
+		radio_modulated_tx_duty_cycle(config->mode,
+									  config->params.modulated_tx_duty_cycle.txpower,
+									  config->params.modulated_tx_duty_cycle.channel,
+									  config->params.modulated_tx_duty_cycle.pattern,
+									  config->params.modulated_tx_duty_cycle.duty_cycle);
+		break;
+	default:
+		break;
+	}
+
+	return 0;
+}
+
+void radio_test_cancel(void)
+{
+	tx_elapsed_stop();
+
+	if (tx_duty_cycle_active)
+	{
+		radio_tx_duty_cycle_stop();
+	}
+	if (tx_count_active)
+	{
+		radio_tx_count_stop();
+	}
+	if (tx_throughput_active)
+	{
+		radio_tx_throughput_stop();
+	}
+	radio_ping_pong_stop();
+	radio_ack_stop();
+
+	nrf_timer_task_trigger(timer.p_reg, NRF_TIMER_TASK_STOP);
+	nrf_timer_task_trigger(timer.p_reg, NRF_TIMER_TASK_CLEAR);
+	nrf_timer_shorts_set(timer.p_reg, 0);
+
+	sweep_active = false;
+
+	if (ppi_set_sweep.allocated)
+	{
+		nrfx_gppi_channels_disable(BIT(ppi_radio_disable));
+		nrfx_gppi_event_endpoint_clear(ppi_radio_disable,
+									   nrf_timer_event_address_get(timer.p_reg, NRF_TIMER_EVENT_COMPARE0));
+		nrfx_gppi_task_endpoint_clear(ppi_radio_disable,
+									  nrf_radio_task_address_get(NRF_RADIO, NRF_RADIO_TASK_DISABLE));
+	}
+	if (ppi_set_duty_cycle.allocated)
+	{
+		nrfx_gppi_channels_disable(BIT(ppi_radio_start));
+		// nrfx_gppi_event_endpoint_clear(ppi_radio_start,
+		// 							   nrf_egu_event_address_get(RADIO_TEST_EGU, RADIO_TEST_EGU_EVENT));
+		nrfx_gppi_task_endpoint_clear(ppi_radio_start,
+									  nrf_radio_task_address_get(NRF_RADIO, NRF_RADIO_TASK_TXEN));
+		nrfx_gppi_task_endpoint_clear(ppi_radio_start,
+									  nrf_radio_task_address_get(NRF_RADIO, NRF_RADIO_TASK_RXEN));
+		nrfx_gppi_fork_endpoint_clear(ppi_radio_start,
+									  nrf_timer_task_address_get(timer.p_reg, NRF_TIMER_TASK_START));
+		nrfx_gppi_event_endpoint_clear(ppi_radio_start,
+									   nrf_timer_event_address_get(timer.p_reg, NRF_TIMER_EVENT_COMPARE1));
+	}
+	if (ppi_set_rx.allocated)
+	{
+		nrfx_gppi_channels_disable(BIT(ppi_rx_timestamp));
+	}
+
+	radio_disable();
+}
+
+void radio_rx_stats_get(struct radio_rx_stats *rx_stats)
+{
+	size_t size;
+	size = RADIO_MAX_PAYLOAD_LEN;
+	rx_stats->last_packet.buf = (uint8_t *)rx_packet;
+	rx_stats->last_packet.len = size;
+	rx_stats->packet_cnt = rx_packet_cnt;
+}
+
+void radio_rssi_stats_reset(void)
+{
+	unsigned int key = irq_lock();
+
+	memset(&rssi_stats, 0, sizeof(rssi_stats));
+	rssi_stats.min = UINT8_MAX;
+
+	irq_unlock(key);
+}
+
+uint16_t radio_rssi_stats_write(uint8_t *buf)
+{
+	struct radio_rssi_stats stats;
+
+	/* The 64 bit sums can't be read in one go */
+	unsigned int key = irq_lock();
+	stats = rssi_stats;
+	irq_unlock(key);
+
+	buf[0] = stats.min;
+	buf[1] = stats.max;
+	put_u32(buf + 2, stats.sum & 0xFFFFFFFF);
+	put_u32(buf + 6, stats.sum >> 32);
+	put_u32(buf + 10, stats.sum_sq & 0xFFFFFFFF);
+	put_u32(buf + 14, stats.sum_sq >> 32);
+
+	for (int i = 0; i < RADIO_RSSI_BINS; i++)
+	{
+		put_u32(buf + 18 + 4 * i, stats.hist[i]);
+	}
+
+	return RADIO_RSSI_STATS_LEN;
+}
+
+void radio_seq_stats_reset(void)
+{
+	unsigned int key = irq_lock();
+
+	memset(&seq_stats, 0, sizeof(seq_stats));
+
+	irq_unlock(key);
+}
+
+uint16_t radio_seq_stats_write(uint8_t *buf)
+{
+	struct radio_seq_stats stats;
+
+	unsigned int key = irq_lock();
+	stats = seq_stats;
+	irq_unlock(key);
+
+	put_u32(buf, stats.received);
+	put_u32(buf + 4, stats.lost);
+	put_u32(buf + 8, stats.duplicates);
+	put_u32(buf + 12, stats.reordered);
+
+	for (int i = 0; i < RADIO_SEQ_BURST_BINS; i++)
+	{
+		put_u32(buf + 16 + 4 * i, stats.bursts[i]);
+	}
+
+	return RADIO_SEQ_STATS_LEN;
+}
+
+void radio_ber_stats_reset(void)
+{
+	unsigned int key = irq_lock();
+
+	memset(&ber_stats, 0, sizeof(ber_stats));
+
+	irq_unlock(key);
+}
+
+uint16_t radio_ber_stats_write(uint8_t *buf)
+{
+	struct radio_ber_stats stats;
+
+	unsigned int key = irq_lock();
+	stats = ber_stats;
+	irq_unlock(key);
+
+	put_u32(buf, stats.packets);
+	put_u32(buf + 4, stats.errored_packets);
+	put_u32(buf + 8, stats.unsynced);
+	put_u32(buf + 12, stats.bits & 0xFFFFFFFF);
+	put_u32(buf + 16, stats.bits >> 32);
+	put_u32(buf + 20, stats.bit_errors & 0xFFFFFFFF);
+	put_u32(buf + 24, stats.bit_errors >> 32);
+
+	for (int i = 0; i < RADIO_BER_BINS; i++)
+	{
+		put_u32(buf + 28 + 4 * i, stats.hist[i]);
+	}
+
+	return RADIO_BER_STATS_LEN;
+}
+
+uint16_t radio_tx_stats_write(uint8_t *buf)
+{
+	uint32_t airtime_ns = radio_airtime_ns(radio_packet_len);
+
+	put_u32(buf, radio_tx_airtime_ns);
+	put_u32(buf + 4, radio_tx_duty_cycle_ppm);
+	put_u32(buf + 8, radio_tx_period_ns);
+	put_u32(buf + 12, airtime_ns ? 1000000000000ULL / airtime_ns : 0);
+
+	return RADIO_TX_STATS_LEN;
+}
+
+uint32_t radio_tx_ticks(void)
+{
+	return (tx_running ? timer2_ticks() : tx_end_ticks) - tx_start_ticks;
+}
+
+uint16_t radio_airtime_stats_write(uint8_t *buf, uint32_t packets, uint32_t good_packets,
+								   uint32_t ticks)
+{
+	uint32_t airtime_ns = radio_airtime_ns(radio_packet_len);
+	uint64_t airtime_us = (uint64_t)packets * airtime_ns / 1000;
+	uint64_t payload_bits = (uint64_t)good_packets * 8 * (radio_packet_len - radio_profile->crc_in_length);
+
+	put_u32(buf, airtime_ns);
+	put_u32(buf + 4, (uint32_t)MIN(airtime_us, UINT32_MAX));
+	put_u32(buf + 8, ticks ? (uint64_t)packets * 1000 * RADIO_TIMESTAMP_HZ / ticks : 0);
+	put_u32(buf + 12, ticks ? payload_bits * RADIO_TIMESTAMP_HZ / ticks : 0);
+
+	return RADIO_AIRTIME_STATS_LEN;
+}
+
+uint16_t radio_rtt_stats_write(uint8_t *buf, nrf_radio_mode_t mode)
+{
+	struct radio_rtt_stats stats;
+
+	unsigned int key = irq_lock();
+	stats = rtt_stats[radio_profile_get(mode)->phy];
+	irq_unlock(key);
+
+	/* Median and 99th percentile from the histogram */
+	uint32_t median = 0;
+	uint32_t p99 = 0;
+	uint32_t seen = 0;
+
+	for (uint8_t bin = 0; bin < RADIO_RTT_BINS && stats.exchanges > 0; bin++)
+	{
+		if (seen < (stats.exchanges + 1) / 2 && seen + stats.hist[bin] >= (stats.exchanges + 1) / 2)
+		{
+			median = CLAMP(rtt_bin_value(bin), stats.min, stats.max);
+		}
+		if (seen < stats.exchanges - stats.exchanges / 100 &&
+			seen + stats.hist[bin] >= stats.exchanges - stats.exchanges / 100)
+		{
+			p99 = CLAMP(rtt_bin_value(bin), stats.min, stats.max);
+		}
+		seen += stats.hist[bin];
+	}
+
+	put_u32(buf, stats.exchanges);
+	put_u32(buf + 4, stats.lost);
+	put_u32(buf + 8, stats.exchanges ? stats.min : 0);
+	put_u32(buf + 12, median);
+	put_u32(buf + 16, p99);
+	put_u32(buf + 20, stats.max);
+	put_u32(buf + 24, stats.exchanges ? stats.sum / stats.exchanges : 0);
+	for (uint8_t i = 0; i < RADIO_RTT_BINS; i++)
+	{
+		put_u32(buf + 28 + 4 * i, stats.hist[i]);
+	}
+
+	return RADIO_RTT_STATS_LEN;
+}
+
+uint16_t radio_ack_stats_write(uint8_t *buf)
+{
+	struct radio_ack_stats stats;
+
+	unsigned int key = irq_lock();
+	stats = ack_stats;
+	irq_unlock(key);
+
+	put_u32(buf, stats.attempts);
+	put_u32(buf + 4, stats.delivered);
+	put_u32(buf + 8, stats.failed);
+	put_u32(buf + 12, stats.acks);
+	put_u32(buf + 16, stats.duplicates);
+	for (uint8_t i = 0; i < RADIO_ACK_ATTEMPT_BINS; i++)
+	{
+		put_u32(buf + 20 + 4 * i, stats.hist[i]);
+	}
+
+	return RADIO_ACK_STATS_LEN;
+}
+
+void radio_channel_stats_reset(void)
+{
+	unsigned int key = irq_lock();
+
+	memset(channel_stats, 0, sizeof(channel_stats));
+
+	irq_unlock(key);
+}
+
+uint16_t radio_channel_stats_write(uint8_t *buf, uint8_t first, uint8_t count)
+{
+	uint16_t len = 0;
+
+	for (uint8_t channel = first; channel < RADIO_CHANNELS && channel - first < count; channel++)
+	{
+		struct radio_channel_stats stats;
+
+		unsigned int key = irq_lock();
+		stats = channel_stats[channel];
+		irq_unlock(key);
+
+		put_u32(buf + len, stats.packets);
+		put_u32(buf + len + 4, stats.crcok);
+		put_u32(buf + len + 8, stats.rssi);
+		len += RADIO_CHANNEL_STATS_LEN;
+	}
+
+	return len;
+}
+
+/* Copies the last completed packet, again if the radio got round to
+ * receiving into its buffer meanwhile
+ */
+static void rx_packet_copy(uint8_t *buf, uint16_t len)
+{
+	uint32_t done;
+
+	do
+	{
+		done = rx_done_count;
+		compiler_barrier();
+
+		memcpy(buf, rx_packets[(done + RX_PACKET_BUFS - 1) % RX_PACKET_BUFS], len);
+
+		compiler_barrier();
+	} while (rx_done_count - done >= RX_PACKET_BUFS - 1);
+}
+
+static uint16_t write_rx_stats_to_buf(uint8_t *rx_log_buf)
+{
+	rx_log_buf[0] = radio_total_rssi & 0xFF;
+	rx_log_buf[1] = (radio_total_rssi >> 8) & 0xFF;
+	rx_log_buf[2] = (radio_total_rssi >> 16) & 0xFF;
+	rx_log_buf[3] = (radio_total_rssi >> 24) & 0xFF;
+
+	rx_log_buf[4] = radio_packets_received & 0xFF;
+	rx_log_buf[5] = (radio_packets_received >> 8) & 0xFF;
+	rx_log_buf[6] = (radio_packets_received >> 16) & 0xFF;
+	rx_log_buf[7] = (radio_packets_received >> 24) & 0xFF;
+
+	rx_log_buf[8] = radio_total_crcok & 0xFF;
+	rx_log_buf[9] = (radio_total_crcok >> 8) & 0xFF;
+	rx_log_buf[10] = (radio_total_crcok >> 16) & 0xFF;
+	rx_log_buf[11] = (radio_total_crcok >> 24) & 0xFF;
+
+	uint32_t ticks = NRF_TIMER2->CC[1];
+
+	rx_log_buf[12] = ticks & 0xFF;
+	rx_log_buf[13] = (ticks >> 8) & 0xFF;
+	rx_log_buf[14] = (ticks >> 16) & 0xFF;
+	rx_log_buf[15] = (ticks >> 24) & 0xFF;
+
+	rx_log_buf[16] = rssi;
+	rx_log_buf[17] = radio_packet_len;
+
+	radio_rssi_stats_write(rx_log_buf + 18);
+
+	return RX_LOG_HEADER_LEN;
+}
+
+/* Takes the counters of a snapshot every RX_LOG_PERIOD_MS from the timer
+ * ISR, so the cadence doesn't depend on how long the flash takes. Snapshots
+ * the writer hasn't made room for are dropped and counted.
+ */
+static void rx_log_timer_handler(struct k_timer *timer)
+{
+	ARG_UNUSED(timer);
+
+	rx_log_snapshot.len = write_rx_stats_to_buf(rx_log_snapshot.buf);
+	radio_log_snapshots++;
+
+	if (k_msgq_put(&rx_log_msgq, &rx_log_snapshot, K_NO_WAIT) != 0)
+	{
+		radio_log_dropped++;
+	}
+	k_sem_give(&rx_log_wake);
+}
+
+static K_TIMER_DEFINE(rx_log_timer, rx_log_timer_handler, NULL);
+
+void radio_logging_start(void)
+{
+	radio_log_snapshots = 0;
+	radio_log_dropped = 0;
+	radio_rx_events = 0;
+	radio_rx_events_dropped = 0;
+	rx_event_gap = 0;
+	radio_logging_active = true;
+
+	k_timer_start(&rx_log_timer, K_NO_WAIT, K_MSEC(RX_LOG_PERIOD_MS));
+}
+
+void radio_logging_stop(void)
+{
+	k_timer_stop(&rx_log_timer);
+	radio_logging_active = false;
+
+	/* Wait for the writer to get through the snapshots and events still
+	 * queued. The timer is stopped, so its snapshot buffer is free to ask
+	 * with.
+	 */
+	rx_log_snapshot.len = 0;
+	k_msgq_put(&rx_log_msgq, &rx_log_snapshot, K_FOREVER);
+	k_sem_give(&rx_log_wake);
+	k_sem_take(&rx_log_drained, K_FOREVER);
+}
+
+/* Called from radio_handler() when a packet has been received, keep it short */
+static inline void rx_event_push(bool crc_ok)
+{
+	uint32_t head = rx_event_head;
+
+	if (head - rx_event_tail == RX_EVENT_RING_LEN)
+	{
+		rx_event_gap++;
+		radio_rx_events_dropped++;
+		return;
+	}
+
+	struct rx_event *event = &rx_event_ring[head % RX_EVENT_RING_LEN];
+
+	event->timestamp = NRF_TIMER2->CC[1];
+	event->rssi = rssi;
+	event->flags = crc_ok ? RX_EVENT_CRC_OK : 0;
+	event->len = rx_packet[0];
+	event->dropped = MIN(rx_event_gap, UINT8_MAX);
+	rx_event_gap = 0;
+
+	/* The event has to be in the ring before the writer can see it */
+	compiler_barrier();
+	rx_event_head = head + 1;
+	radio_rx_events++;
+
+	/* Short packets fill the ring well within RX_EVENT_DRAIN_MS */
+	if (head + 1 - rx_event_tail == RX_EVENT_HIGH_WATER)
+	{
+		k_sem_give(&rx_log_wake);
+	}
+}
+
+/* Writes out the events in the ring, RX_EVENTS_PER_RECORD to a record:
+ *   0  TIMER2 ticks at ADDRESS, 4 bytes
+ *   4  RSSI, -dBm
+ *   5  flags, bit 0 set if the CRC was ok
+ *   6  packet length
+ *   7  events dropped right before this one, saturating
+ */
+static void rx_events_drain(void)
+{
+	static uint8_t buf[RX_EVENTS_PER_RECORD * RX_EVENT_SIZE];
+
+	while (true)
+	{
+		uint32_t tail = rx_event_tail;
+		uint32_t n = MIN(rx_event_head - tail, RX_EVENTS_PER_RECORD);
+
+		if (n == 0)
+		{
+			return;
+		}
+
+		/* Don't read events before seeing the head that covers them */
+		compiler_barrier();
+
+		for (uint32_t i = 0; i < n; i++)
+		{
+			const struct rx_event *event = &rx_event_ring[(tail + i) % RX_EVENT_RING_LEN];
+			uint8_t *out = buf + i * RX_EVENT_SIZE;
+
+			out[0] = event->timestamp & 0xFF;
+			out[1] = (event->timestamp >> 8) & 0xFF;
+			out[2] = (event->timestamp >> 16) & 0xFF;
+			out[3] = (event->timestamp >> 24) & 0xFF;
+			out[4] = event->rssi;
+			out[5] = event->flags;
+			out[6] = event->len;
+			out[7] = event->dropped;
+		}
+
+		/* Copied out, the ISR can have the slots back before the flash write */
+		compiler_barrier();
+		rx_event_tail = tail + n;
+
+		int err = fs_write_record(fs_flash_device, FS_RECORD_RX_EVENTS, buf, n * RX_EVENT_SIZE);
+		if (err != 0)
+		{
+			printk("rx_events_drain: fs_write_record err=%d\n", err);
+		}
+	}
+}
+
+/* The only place that waits for the flash */
+static void write_rx_log_thread(void)
+{
+	static struct rx_log_msg msg;
+	static uint8_t record[RX_LOG_HEADER_LEN + RADIO_MAX_PAYLOAD_LEN];
+
+	while (true)
+	{
+		k_sem_take(&rx_log_wake, K_MSEC(RX_EVENT_DRAIN_MS));
+
+		rx_events_drain();
+
+		while (k_msgq_get(&rx_log_msgq, &msg, K_NO_WAIT) == 0)
+		{
+			if (msg.len == 0)
+			{
+				k_sem_give(&rx_log_drained);
+				continue;
+			}
+
+			/* The packet is the last one completed by the time it is
+			 * written, not by the time of the counters
+			 */
+			uint8_t len = msg.buf[17];
+
+			memcpy(record, msg.buf, RX_LOG_HEADER_LEN);
+			rx_packet_copy(record + RX_LOG_HEADER_LEN, len);
+
+			int err = fs_write_packet(fs_flash_device, record, RX_LOG_HEADER_LEN + len);
 			if (err != 0)
 			{
 				printk("write_rx_log_thread: fs_write_packet err=%d\n", err);
 			}
-			k_msleep(250);
+
+			/* The ring kept filling during the write */
+			rx_events_drain();
 		}
-		else
+	}
+}
+
+/* Gap detection on the sequence numbers of packets received intact */
+static inline void rx_sequence_check(uint32_t seq)
+{
+	seq_stats.received++;
+
+	if (seq >= seq_stats.next)
+	{
+		uint32_t gap = seq - seq_stats.next;
+
+		if (gap > 0)
 		{
-			k_msleep(100);
+			seq_stats.lost += gap;
+			seq_stats.bursts[MIN(31 - __builtin_clz(gap), RADIO_SEQ_BURST_BINS - 1)]++;
+		}
+		seq_stats.next = seq + 1;
+	}
+	else if (seq == seq_stats.next - 1)
+	{
+		seq_stats.duplicates++;
+	}
+	else
+	{
+		/* Counted as lost when the gap was seen */
+		seq_stats.reordered++;
+		if (seq_stats.lost > 0)
+		{
+			seq_stats.lost--;
 		}
 	}
 }
 
-void radio_handler()
+/* Bit errors in rx_packet[first, end) against rx_expected. Both buffers are
+ * word aligned, so the bulk is compared a word at a time.
+ */
+static inline uint32_t rx_bit_errors(uint16_t first, uint16_t end)
 {
-	if (nrf_radio_event_check(NRF_RADIO, NRF_RADIO_EVENT_CRCOK))
+	uint32_t errors = 0;
+	uint16_t i = first;
+
+	for (; i < end && (i % 4) != 0; i++)
 	{
-		nrf_radio_event_clear(NRF_RADIO, NRF_RADIO_EVENT_CRCOK);
+		errors += __builtin_popcount(rx_packet[i] ^ rx_expected[i]);
+	}
 
-		radio_is_active_counter = 1000;
+	for (; i + 4 <= end; i += 4)
+	{
+		uint32_t diff = *(const uint32_t *)(rx_packet + i) ^ *(const uint32_t *)(rx_expected + i);
+
+		errors += __builtin_popcount(diff);
+	}
+
+	for (; i < end; i++)
+	{
+		errors += __builtin_popcount(rx_packet[i] ^ rx_expected[i]);
+	}
+
+	return errors;
+}
+
+/* Syncs to the PRBS in the received payload: the first three words on the TX
+ * word grid that predict the next two exactly seed the expected payload from
+ * there on. Returns where the check starts, `end` if the packet never syncs.
+ */
+static uint16_t rx_prbs_sync(uint16_t first, uint16_t end)
+{
+	struct prbs prbs = {.pattern = radio_pattern};
+
+	for (uint16_t i = first; i + 5 * 4 <= end; i += 4)
+	{
+		prbs.w[2] = get_u32(rx_packet + i);
+		prbs.w[1] = get_u32(rx_packet + i + 4);
+		prbs.w[0] = get_u32(rx_packet + i + 8);
+
+		if (prbs_next(&prbs) != get_u32(rx_packet + i + 12) ||
+			prbs_next(&prbs) != get_u32(rx_packet + i + 16))
+		{
+			continue;
+		}
+
+		memcpy(rx_expected + i, rx_packet + i, 5 * 4);
+		for (uint16_t j = i + 5 * 4; j < end; j += 4)
+		{
+			put_u32(rx_expected + j, prbs_next(&prbs));
+		}
+
+		return i;
+	}
+
+	return end;
+}
+
+/* Compares the length field and the payload after any sequence header. The
+ * payload is taken to be the configured size, whatever the received length
+ * field says. PRBS payloads are only compared from where they sync.
+ */
+static inline void rx_ber_check(void)
+{
+	uint16_t first = radio_payload_first();
+	uint16_t end = radio_payload_end();
+	uint32_t errors = __builtin_popcount(rx_packet[0] ^ rx_expected[0]);
+	uint32_t bits = 8;
+
+	if (radio_pattern_is_prbs())
+	{
+		first = rx_prbs_sync(first, end);
+		if (first == end)
+		{
+			ber_stats.unsynced++;
+			return;
+		}
+	}
+
+	if (end > first)
+	{
+		errors += rx_bit_errors(first, end);
+		bits += 8 * (end - first);
+	}
+
+	ber_stats.packets++;
+	ber_stats.bits += bits;
+	ber_stats.bit_errors += errors;
+
+	if (errors > 0)
+	{
+		ber_stats.errored_packets++;
+	}
+	ber_stats.hist[errors == 0 ? 0 : MIN(32 - __builtin_clz(errors), RADIO_BER_BINS - 1)]++;
+}
+
+/* Everything about a received packet is collected at its END: ADDRESS
+ * captured the arrival time into TIMER2 CC[1] over PPI and started the RSSI
+ * sample through the ADDRESS_RSSISTART short.
+ */
+static inline void rx_packet_end(void)
+{
+	uint32_t done = rx_done_count;
+	bool crc_ok = nrf_radio_crc_status_check(NRF_RADIO);
+
+	/* The next packet is already coming in, queue the one after it */
+	nrf_radio_packetptr_set(NRF_RADIO, rx_packets[(done + 2) % RX_PACKET_BUFS]);
+	rx_packet = rx_packets[done % RX_PACKET_BUFS];
+
+	rssi = nrf_radio_rssi_sample_get(NRF_RADIO);
+	radio_total_rssi += rssi;
+	radio_packets_received++;
 
+	rssi_stats.min = MIN(rssi_stats.min, rssi);
+	rssi_stats.max = MAX(rssi_stats.max, rssi);
+	rssi_stats.sum += rssi;
+	rssi_stats.sum_sq += (uint32_t)rssi * rssi;
+	rssi_stats.hist[MIN(rssi / RADIO_RSSI_BIN_WIDTH, RADIO_RSSI_BINS - 1)]++;
+
+	struct radio_channel_stats *channel = &channel_stats[current_channel];
+
+	channel->packets++;
+	channel->rssi += rssi;
+
+	if (crc_ok)
+	{
 		radio_total_crcok++;
+		channel->crcok++;
+		radio_is_active_counter = 1000;
+	}
+
+	if (!radio_has_received)
+	{
+		radio_has_received = true;
+
+		// Keep when the first packet was received in CC[0]
+		NRF_TIMER2->CC[0] = NRF_TIMER2->CC[1];
+	}
+
+	if (radio_sequence && crc_ok && rx_packet[0] >= RADIO_SEQ_HEADER_LEN)
+	{
+		rx_sequence_check(get_u32(rx_packet + 1));
+	}
+
+	if (radio_ber)
+	{
+		rx_ber_check();
+	}
+
+	if (radio_logging_active)
+	{
+		rx_event_push(crc_ok);
 	}
 
-	if (nrf_radio_event_check(NRF_RADIO, NRF_RADIO_EVENT_RSSIEND))
+	compiler_barrier();
+	rx_done_count = done + 1;
+}
+
+/* Packet tx_seq is on air and the pointer to it has been taken, so the
+ * other buffer can be filled and queued before its END starts the next one
+ */
+static inline void tx_packet_address(void)
+{
+	uint8_t *next = tx_packet[++tx_seq % 2];
+
+	if (radio_pattern_is_prbs())
+	{
+		radio_payload_fill(next);
+	}
+	if (radio_sequence)
 	{
-		nrf_radio_event_clear(NRF_RADIO, NRF_RADIO_EVENT_RSSIEND);
+		tx_sequence_stamp(next, tx_seq);
+	}
+	nrf_radio_packetptr_set(NRF_RADIO, next);
+}
+
+/* TIMER0 disabled the radio, move it on to the next channel. A packet cut
+ * short by the hop never ENDs, the next one goes into its buffer.
+ */
+static inline void radio_sweep_hop(void)
+{
+	current_channel = current_channel >= sweep_channel_end ? sweep_channel_start : current_channel + 1;
+	radio_channel_set(nrf_radio_mode_get(NRF_RADIO), current_channel);
 
-		rssi = nrf_radio_rssi_sample_get(NRF_RADIO);
+	if (radio_receiving)
+	{
+		rx_dma_start();
+		nrf_radio_task_trigger(NRF_RADIO, NRF_RADIO_TASK_RXEN);
+	}
+	else
+	{
+		nrf_radio_task_trigger(NRF_RADIO, NRF_RADIO_TASK_TXEN);
+	}
+}
 
-		// Stop after 1 sample
-		nrf_radio_task_trigger(NRF_RADIO, NRF_RADIO_TASK_RSSISTOP);
+void radio_handler()
+{
+	/* TXREADY sets READY too and nothing clears it, only rx_dma_start()
+	 * asks for it
+	 */
+	if (radio_receiving && nrf_radio_int_enable_check(NRF_RADIO, NRF_RADIO_INT_READY_MASK) &&
+		nrf_radio_event_check(NRF_RADIO, NRF_RADIO_EVENT_READY))
+	{
+		nrf_radio_event_clear(NRF_RADIO, NRF_RADIO_EVENT_READY);
+		nrf_radio_int_disable(NRF_RADIO, NRF_RADIO_INT_READY_MASK);
 
-		radio_total_rssi += rssi;
+		nrf_radio_packetptr_set(NRF_RADIO, rx_packets[(rx_done_count + 1) % RX_PACKET_BUFS]);
 	}
 
 	if (nrf_radio_event_check(NRF_RADIO, NRF_RADIO_EVENT_ADDRESS))
 	{
 		nrf_radio_event_clear(NRF_RADIO, NRF_RADIO_EVENT_ADDRESS);
 
-		if (!radio_has_received)
+		/* Ping-pong and acknowledged frames set their own PACKETPTR */
+		if (!radio_receiving && !ping_active && !pong_active && !ack_tx_active && !ack_rx_active)
 		{
-			radio_has_received = true;
-
-			// Store when the first packet is received into CC[0]
-			NRF_TIMER2->TASKS_CAPTURE[0] = TIMER_TASKS_CAPTURE_TASKS_CAPTURE_Trigger;
+			tx_packet_address();
 		}
-
-		NRF_TIMER2->TASKS_CAPTURE[1] = TIMER_TASKS_CAPTURE_TASKS_CAPTURE_Trigger;
-
-		radio_packets_received++;
 	}
 
-	if (nrf_radio_event_check(NRF_RADIO, NRF_RADIO_EVENT_END) | nrf_radio_event_check(NRF_RADIO, NRF_RADIO_EVENT_PHYEND))
+	/* Ping-pong and the ACK transmitter read END in the DISABLED interrupt */
+	if (!ping_active && !pong_active && !ack_tx_active &&
+		(nrf_radio_event_check(NRF_RADIO, NRF_RADIO_EVENT_END) | nrf_radio_event_check(NRF_RADIO, NRF_RADIO_EVENT_PHYEND)))
 	{
 		nrf_radio_event_clear(NRF_RADIO, NRF_RADIO_EVENT_END);
 		nrf_radio_event_clear(NRF_RADIO, NRF_RADIO_EVENT_PHYEND);
 
-		radio_packets_sent++;
-		radio_is_active_counter = 1000;
+		if (ack_rx_active)
+		{
+			ack_frame_end();
+		}
+		else if (radio_receiving)
+		{
+			rx_packet_end();
+		}
+		else
+		{
+			radio_packets_sent++;
+			radio_is_active_counter = 1000;
+		}
+	}
+
+	/* Duty-cycled TX polls DISABLED once, only sweeps, counted TX,
+	 * ping-pong and acknowledged frames take it here
+	 */
+	if ((sweep_active || tx_count_active || ping_active || pong_active || ack_tx_active || ack_rx_active) &&
+		nrf_radio_event_check(NRF_RADIO, NRF_RADIO_EVENT_DISABLED))
+	{
+		nrf_radio_event_clear(NRF_RADIO, NRF_RADIO_EVENT_DISABLED);
+
+		if (sweep_active)
+		{
+			radio_sweep_hop();
+		}
+		else if (ping_active)
+		{
+			ping_disabled();
+		}
+		else if (pong_active)
+		{
+			pong_disabled();
+		}
+		else if (ack_tx_active)
+		{
+			ack_tx_disabled();
+		}
+		else if (ack_rx_active)
+		{
+			ack_rx_disabled();
+		}
+		else
+		{
+			/* The last packet is out, nothing starts the radio again */
+			nrf_radio_int_disable(NRF_RADIO, NRF_RADIO_INT_DISABLED_MASK);
+			tx_elapsed_stop();
+			if (tx_done_cb)
+			{
+				tx_done_cb();
+			}
+		}
 	}
 }
 
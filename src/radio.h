@@ -28,15 +28,202 @@ extern uint32_t radio_total_crcok;
 extern bool radio_has_received;
 
 extern uint8_t packet_size;
+extern bool radio_sequence;
+extern bool radio_ber;
 
 extern uint32_t radio_packets_sent;
+extern uint32_t radio_tx_airtime_ns;
+extern uint32_t radio_tx_duty_cycle_ppm;
+extern uint32_t radio_tx_period_ns;
+extern uint32_t radio_frames_delivered;
 
 extern bool radio_logging_active;
+extern uint32_t radio_log_snapshots;
+extern uint32_t radio_log_dropped;
+extern uint32_t radio_rx_events;
+extern uint32_t radio_rx_events_dropped;
+
+/** Number of RSSI histogram bins. */
+#define RADIO_RSSI_BINS 16
+/** Width of an RSSI histogram bin in dB, the bins cover 0 to -127 dBm. */
+#define RADIO_RSSI_BIN_WIDTH 8
+/** Length of the RSSI statistics written by radio_rssi_stats_write(). */
+#define RADIO_RSSI_STATS_LEN (18 + 4 * RADIO_RSSI_BINS)
+
+/**@brief RSSI distribution of the received packets, samples are -dBm.
+ *
+ * The sums are exact, so mean and variance can be derived without the
+ * rounding a running update would add. There is one sample per packet in
+ * radio_packets_received.
+ */
+struct radio_rssi_stats
+{
+	/** Smallest sample, 0xFF before the first packet. */
+	uint8_t min;
+
+	/** Largest sample. */
+	uint8_t max;
+
+	/** Sum of the samples. */
+	uint64_t sum;
+
+	/** Sum of the squared samples. */
+	uint64_t sum_sq;
+
+	/** Number of samples in each RADIO_RSSI_BIN_WIDTH dB bin. */
+	uint32_t hist[RADIO_RSSI_BINS];
+};
+
+/** Length of the sequence header at the start of sequence numbered payloads. */
+#define RADIO_SEQ_HEADER_LEN 8
+/** Number of loss burst length bins, bin i counts bursts of 2^i to 2^(i+1)-1. */
+#define RADIO_SEQ_BURST_BINS 8
+/** Length of the statistics written by radio_seq_stats_write(). */
+#define RADIO_SEQ_STATS_LEN (16 + 4 * RADIO_SEQ_BURST_BINS)
+
+/**@brief Loss statistics from the sequence numbers of intact packets. */
+struct radio_seq_stats
+{
+	/** Packets checked. */
+	uint32_t received;
+
+	/** Sequence numbers skipped and not seen since. */
+	uint32_t lost;
+
+	/** Packets repeating the last sequence number. */
+	uint32_t duplicates;
+
+	/** Packets older than the last sequence number. */
+	uint32_t reordered;
+
+	/** Sequence number expected next. */
+	uint32_t next;
+
+	/** Lengths of the runs of lost packets. */
+	uint32_t bursts[RADIO_SEQ_BURST_BINS];
+};
+
+/** Number of per-packet bit error bins, bin 0 counts error free packets and
+ *  bin i > 0 packets with 2^(i-1) to 2^i-1 bit errors.
+ */
+#define RADIO_BER_BINS 12
+/** Length of the statistics written by radio_ber_stats_write(). */
+#define RADIO_BER_STATS_LEN (28 + 4 * RADIO_BER_BINS)
+
+/**@brief Bit errors of received payloads against the known TX payload. */
+struct radio_ber_stats
+{
+	/** Packets compared, including those failing their CRC. */
+	uint32_t packets;
+
+	/** Packets with at least one bit error. */
+	uint32_t errored_packets;
+
+	/** PRBS packets too damaged to sync to, not compared. */
+	uint32_t unsynced;
+
+	/** Bits compared. */
+	uint64_t bits;
+
+	/** Bits found wrong. */
+	uint64_t bit_errors;
+
+	/** Packets by their number of bit errors. */
+	uint32_t hist[RADIO_BER_BINS];
+};
+
+/** Number of radio modes with a profile. */
+#define RADIO_PHYS 7
+
+/** Round trip time bins: bins 0 to 7 hold 0 to 7 us, after that every power
+ *  of two is split in RADIO_RTT_SUB_BINS bins. The last bin is open ended.
+ */
+#define RADIO_RTT_SUB_BINS 8
+#define RADIO_RTT_BINS 120
+/** Length of the statistics written by radio_rtt_stats_write(). */
+#define RADIO_RTT_STATS_LEN (28 + 4 * RADIO_RTT_BINS)
+
+/**@brief Round trip times of the pings of one PHY, from the start of the
+ *        ping on air to the address of its echo.
+ */
+struct radio_rtt_stats
+{
+	/** Pings echoed. */
+	uint32_t exchanges;
+
+	/** Pings without a valid echo before the timeout. */
+	uint32_t lost;
+
+	/** Shortest and longest round trip, us. */
+	uint32_t min;
+	uint32_t max;
+
+	/** Sum of the round trips, us. */
+	uint64_t sum;
+
+	/** Round trips by bin. */
+	uint32_t hist[RADIO_RTT_BINS];
+};
+
+/** Most attempts at one acknowledged frame, the first and 15 retries. */
+#define RADIO_ACK_ATTEMPT_BINS 16
+/** Length of the statistics written by radio_ack_stats_write(). */
+#define RADIO_ACK_STATS_LEN (20 + 4 * RADIO_ACK_ATTEMPT_BINS)
+
+/**@brief Counters of the last ACK_TX or ACK_RX test, each end fills in its
+ *        own.
+ */
+struct radio_ack_stats
+{
+	/** Frames sent including retries, or frames received. */
+	uint32_t attempts;
+
+	/** Frames acknowledged, or intact frames received for the first time. */
+	uint32_t delivered;
+
+	/** Frames given up on after the last retry, transmitter only. */
+	uint32_t failed;
+
+	/** ACKs sent, receiver only. */
+	uint32_t acks;
+
+	/** Intact frames repeating the last one, their ACK was lost. Receiver
+	 *  only.
+	 */
+	uint32_t duplicates;
+
+	/** Acknowledged frames by the attempts they took, bin i took i + 1. */
+	uint32_t hist[RADIO_ACK_ATTEMPT_BINS];
+};
+
+/** Length of the TX statistics written by radio_tx_stats_write(). */
+#define RADIO_TX_STATS_LEN 16
+
+/** Length of the statistics written by radio_airtime_stats_write(). */
+#define RADIO_AIRTIME_STATS_LEN 16
+
+/** Number of channels, 2400 to 2500 MHz. */
+#define RADIO_CHANNELS 101
+/** Length of the statistics of one channel written by radio_channel_stats_write(). */
+#define RADIO_CHANNEL_STATS_LEN 12
+
+/**@brief RX counters of one channel. */
+struct radio_channel_stats
+{
+	/** Packets received. */
+	uint32_t packets;
+
+	/** Packets received with a valid CRC. */
+	uint32_t crcok;
+
+	/** Sum of the RSSI samples, -dBm. */
+	uint32_t rssi;
+};
 
 /**@brief Radio transmit and address pattern. */
 enum transmit_pattern
 {
-	/** Random pattern. */
+	/** Random pattern, PRBS9. */
 	TRANSMIT_PATTERN_RANDOM,
 
 	/** Pattern 11110000(F0). */
@@ -44,6 +231,9 @@ enum transmit_pattern
 
 	/** Pattern 11001100(CC). */
 	TRANSMIT_PATTERN_11001100,
+
+	/** PRBS15. */
+	TRANSMIT_PATTERN_PRBS15,
 };
 
 /**@brief Radio test mode. */
@@ -66,6 +256,33 @@ enum radio_test_mode
 
 	/** Duty-cycled modulated TX carrier. */
 	MODULATED_TX_DUTY_CYCLE,
+
+	/** Modulated TX, back to back at the highest rate the radio
+	 *  allows. Takes the modulated_tx parameters, packets_num and cb
+	 *  aside.
+	 */
+	TX_THROUGHPUT,
+
+	/** Round trips: sends pings and times their echoes. Takes the
+	 *  modulated_tx parameters, pattern aside, packets_num counting
+	 *  pings.
+	 */
+	PING,
+
+	/** Echoes every packet received back to a PING. Takes the
+	 *  modulated_tx txpower and channel.
+	 */
+	PONG,
+
+	/** Acknowledged frames: sends every frame until an ACK_RX
+	 *  acknowledges it or it runs out of retries.
+	 */
+	ACK_TX,
+
+	/** Acknowledges every intact frame received from an ACK_TX. Takes
+	 *  the ack txpower and channel.
+	 */
+	ACK_RX,
 };
 
 /**@brief Radio test front-end module (FEM) configuration */
@@ -118,7 +335,9 @@ struct radio_test_config
 			 */
 			uint32_t packets_num;
 
-			/** Callback to indicate that TX is finished. */
+			/** Callback to indicate that TX is finished, called from the
+			 * radio interrupt once the last of `packets_num` is sent.
+			 */
 			void (*cb)(void);
 		} modulated_tx;
 
@@ -169,9 +388,34 @@ struct radio_test_config
 			/** Radio channel. */
 			uint8_t channel;
 
-			/** Duty cycle. */
+			/** Duty cycle, percent of the time on air, 1 to 100. */
 			uint32_t duty_cycle;
 		} modulated_tx_duty_cycle;
+
+		struct
+		{
+			/** Radio output power. */
+			int8_t txpower;
+
+			/** Radio channel. */
+			uint8_t channel;
+
+			/**
+			 * Number of frames to deliver or give up on.
+			 * Set to zero to send until cancelled.
+			 */
+			uint32_t packets_num;
+
+			/** Times a frame is sent again without an ACK, up to
+			 * RADIO_ACK_ATTEMPT_BINS - 1.
+			 */
+			uint8_t retries;
+
+			/** Callback to indicate that TX is finished, called from the
+			 * radio interrupt after the last of `packets_num`.
+			 */
+			void (*cb)(void);
+		} ack;
 	} params;
 
 #if CONFIG_FEM
@@ -208,17 +452,155 @@ struct radio_rx_stats
 int radio_test_init();
 
 /**
- * @brief Function for starting radio test.
+ * @brief Function for getting the packet size a test in `mode` uses,
+ *        packet_size cut to the longest packet of the mode.
+ */
+uint8_t radio_packet_len_get(nrf_radio_mode_t mode);
+
+/**
+ * @brief Function for starting radio test, allocating the PPI channels it
+ *        needs the first time.
  *
  * @param[in] config  Radio test configuration.
+ *
+ * @retval 0 If the test was started.
+ * @retval -ENOMEM If the PPI channels of the test could not be allocated.
  */
-void radio_test_start(const struct radio_test_config *config);
+int radio_test_start(const struct radio_test_config *config);
 
 /**
  * @brief Function for stopping ongoing test (Radio and Timer operations).
  */
 void radio_test_cancel(void);
 
+/**
+ * @brief Function for starting to log RX statistics snapshots to flash.
+ */
+void radio_logging_start(void);
+
+/**
+ * @brief Function for stopping RX statistics logging, returns once every
+ *        snapshot taken has been handed to the flash log.
+ */
+void radio_logging_stop(void);
+
+/**
+ * @brief Function for clearing the RSSI statistics before a test.
+ */
+void radio_rssi_stats_reset(void);
+
+/**
+ * @brief Function for writing out the RSSI statistics, little endian:
+ *        min, max, sum (8 bytes), sum of squares (8 bytes), then a 4 byte
+ *        count per histogram bin.
+ *
+ * @param[out] buf  RADIO_RSSI_STATS_LEN bytes.
+ *
+ * @return Number of bytes written.
+ */
+uint16_t radio_rssi_stats_write(uint8_t *buf);
+
+/**
+ * @brief Function for clearing the sequence statistics before a test.
+ */
+void radio_seq_stats_reset(void);
+
+/**
+ * @brief Function for writing out the sequence statistics, little endian
+ *        4 byte fields: received, lost, duplicates, reordered, then a count
+ *        per burst length bin.
+ *
+ * @param[out] buf  RADIO_SEQ_STATS_LEN bytes.
+ *
+ * @return Number of bytes written.
+ */
+uint16_t radio_seq_stats_write(uint8_t *buf);
+
+/**
+ * @brief Function for clearing the bit error statistics before a test.
+ */
+void radio_ber_stats_reset(void);
+
+/**
+ * @brief Function for writing out the bit error statistics, little endian:
+ *        packets (4 bytes), errored packets (4 bytes), unsynced packets
+ *        (4 bytes), bits (8 bytes), bit errors (8 bytes), then a 4 byte count per bit error bin.
+ *
+ * @param[out] buf  RADIO_BER_STATS_LEN bytes.
+ *
+ * @return Number of bytes written.
+ */
+uint16_t radio_ber_stats_write(uint8_t *buf);
+
+/**
+ * @brief Function for serializing the TX statistics, RADIO_TX_STATS_LEN
+ *        bytes, 4 bytes little endian each: airtime of one packet in ns and
+ *        the time on air in ppm of a duty-cycled test, the mean
+ *        packet period in ns measured by a back to back test, and the most
+ *        packets per 1000 s the airtime allows.
+ *
+ * @return Number of bytes written.
+ */
+uint16_t radio_tx_stats_write(uint8_t *buf);
+
+/**
+ * @brief Function for getting how long the last TX test ran, or has been
+ *        running, in TIMER2 ticks.
+ */
+uint32_t radio_tx_ticks(void);
+
+/**
+ * @brief Function for serializing the airtime and throughput of `packets`
+ *        of the configured mode and packet size, `good_packets` of which
+ *        carried their payload, over `ticks` of TIMER2.
+ *
+ *        RADIO_AIRTIME_STATS_LEN bytes, 4 bytes little endian each: airtime
+ *        of one packet in ns, total airtime in us, packets per 1000 s and
+ *        payload goodput in bits per second.
+ *
+ * @return Number of bytes written.
+ */
+uint16_t radio_airtime_stats_write(uint8_t *buf, uint32_t packets, uint32_t good_packets,
+								   uint32_t ticks);
+
+/**
+ * @brief Function for serializing the round trip times of the last PING test
+ *        in `mode`, RADIO_RTT_STATS_LEN bytes, 4 bytes little endian each:
+ *        exchanges, lost, then minimum, median, 99th percentile, maximum and
+ *        mean in us, then the histogram.
+ *
+ * @return Number of bytes written.
+ */
+uint16_t radio_rtt_stats_write(uint8_t *buf, nrf_radio_mode_t mode);
+
+/**
+ * @brief Function for serializing the counters of the last ACK_TX or ACK_RX
+ *        test, RADIO_ACK_STATS_LEN bytes, 4 bytes little endian each:
+ *        attempts, delivered, failed, ACKs, duplicates, then a count per
+ *        number of attempts.
+ *
+ * @return Number of bytes written.
+ */
+uint16_t radio_ack_stats_write(uint8_t *buf);
+
+/**
+ * @brief Function for clearing the per-channel RX counters before a test.
+ */
+void radio_channel_stats_reset(void);
+
+/**
+ * @brief Function for writing out the RX counters of up to `count` channels
+ *        from `first` on, RADIO_CHANNEL_STATS_LEN bytes each: packets, CRC
+ *        ok and RSSI sum, 4 bytes little endian each.
+ *
+ * @param[out] buf    Room for `count` channels.
+ * @param[in]  first  First channel.
+ * @param[in]  count  Maximum number of channels.
+ *
+ * @return Number of bytes written.
+ */
+uint16_t radio_channel_stats_write(uint8_t *buf, uint8_t first, uint8_t count);
+
 /**
  * @brief Function for get RX statistics.
  *
@@ -20,20 +20,85 @@
 #define RADIO_TX_STATS_CHARACTERISTIC 0xDF, 0x14, 0xEA, 0xAC, 0xB1, 0x07, 0x42, 0xEC, \
                                       0xB9, 0x93, 0x73, 0x22, 0x46, 0x10, 0x02, 0x0A
 
+#define RADIO_SESSIONS_CHARACTERISTIC 0x3D, 0x8B, 0x52, 0x1E, 0x90, 0x6A, 0x4F, 0x12, \
+                                      0xB7, 0x05, 0xC9, 0x44, 0x6E, 0x21, 0x9A, 0xD3
+
+#define RADIO_CHANNELS_CHARACTERISTIC 0x5E, 0x31, 0xC7, 0x09, 0xA4, 0x2B, 0x4D, 0x8E, \
+                                      0x96, 0x1F, 0x3A, 0xD0, 0x72, 0xB5, 0x48, 0xE6
+
+#define RADIO_LATENCY_CHARACTERISTIC 0x8B, 0x12, 0x6F, 0xD4, 0x3E, 0xA0, 0x47, 0x59, \
+                                     0xB2, 0x6C, 0x05, 0x9E, 0x4D, 0xF3, 0x21, 0xC8
+
 #define RADIO_SERVICE_UUID BT_UUID_DECLARE_128(RADIO_SERVICE)
 #define RADIO_COMMAND_CHARACTERISTIC_UUID BT_UUID_DECLARE_128(RADIO_COMMAND_CHARACTERISTIC)
 #define RADIO_RX_STATS_CHARACTERISTIC_UUID BT_UUID_DECLARE_128(RADIO_RX_STATS_CHARACTERISTIC)
 #define RADIO_TX_STATS_CHARACTERISTIC_UUID BT_UUID_DECLARE_128(RADIO_TX_STATS_CHARACTERISTIC)
 #define RADIO_READ_LOG_CHARACTERISTIC_UUID BT_UUID_DECLARE_128(RADIO_READ_LOG_CHARACTERISTIC)
+#define RADIO_SESSIONS_CHARACTERISTIC_UUID BT_UUID_DECLARE_128(RADIO_SESSIONS_CHARACTERISTIC)
+#define RADIO_CHANNELS_CHARACTERISTIC_UUID BT_UUID_DECLARE_128(RADIO_CHANNELS_CHARACTERISTIC)
+#define RADIO_LATENCY_CHARACTERISTIC_UUID BT_UUID_DECLARE_128(RADIO_LATENCY_CHARACTERISTIC)
+
+// ATT header of a notification, the rest of the MTU carries log bytes
+#define ATT_NOTIFY_HEADER_SIZE 3
+
+// Number of sessions listed by the sessions characteristic, newest first
+#define MAX_LISTED_SESSIONS 16
+
+// Number of channels read from the channels characteristic at once, keeps
+// the value within the 512 bytes ATT allows
+#define MAX_READ_CHANNELS 42
 
 #define MAX_TRANSMIT_SIZE 240
 uint8_t data_rx[MAX_TRANSMIT_SIZE];
 uint8_t data_tx[MAX_TRANSMIT_SIZE];
 
-uint8_t stats_read_buffer[256];
+// Large enough for a whole log record, or the session list
+uint8_t stats_read_buffer[MAX(MAX(FS_HEADER_SIZE + RADIO_RSSI_STATS_LEN + RADIO_MAX_PAYLOAD_LEN + 32,
+                                  28 + RADIO_RSSI_STATS_LEN + RADIO_SEQ_STATS_LEN + RADIO_BER_STATS_LEN +
+                                      RADIO_AIRTIME_STATS_LEN),
+                              MAX(MAX(MAX_LISTED_SESSIONS * FS_SESSION_SIZE, RADIO_RTT_STATS_LEN),
+                                  2 + MAX_READ_CHANNELS * RADIO_CHANNEL_STATS_LEN))];
+
+static fs_session_t listed_sessions[MAX_LISTED_SESSIONS];
 
 static nrf_radio_mode_t mode;
 static uint8_t tx_power;
+static enum transmit_pattern pattern = TRANSMIT_PATTERN_11110000;
+
+// Tests the TX and RX workers run, picked by the START_* command
+static enum radio_test_mode tx_test = MODULATED_TX;
+static enum radio_test_mode rx_test = RX;
+
+// Sweeps go from `channel` to `sweep_channel_end`, dwelling at least
+// SWEEP_DELAY_MIN_MS on every channel: TIMER0 never reaches a compare of 0,
+// so a sweep without a delay would never hop
+#define SWEEP_DELAY_MIN_MS 1
+static uint8_t sweep_channel_end;
+static uint16_t sweep_delay_ms;
+
+// Percent of the time TX is on air, 100 sends back to back
+static uint8_t duty_cycle = 100;
+
+// Packets a back to back TX sends, 0 sends for `TX_DURATION_MS` instead
+static uint32_t packets_num = 5000;
+
+// Times an acknowledged frame is sent again before giving up on it
+static uint8_t retries = 3;
+
+// Sweeps, duty cycles and TX without a packet count run this long, pings
+// and acknowledged frames stop there at the latest and the responder
+// outlasts them
+#define TX_DURATION_MS 30000
+#define PONG_DURATION_MS (TX_DURATION_MS + 2000)
+// Upper bound on a counted TX, 5000 of the longest Coded PHY packets take
+// under 90 s
+#define TX_COUNT_TIMEOUT K_MINUTES(10)
+
+// Given by the radio once the last counted packet is out
+static K_SEM_DEFINE(tx_done_sem, 0, 1);
+
+// First channel read from the channels characteristic
+static uint8_t read_channel;
 static uint8_t channel;
 
 bool indicate_active = false;
@@ -47,6 +112,11 @@ static K_WORK_DEFINE(receive_rx_packets_worker, receive_rx_packets);
 int send_all_logs(void);
 // static K_WORK_DEFINE(send_all_logs_worker, send_all_logs);
 
+static void tx_done(void)
+{
+    k_sem_give(&tx_done_sem);
+}
+
 int host_service_init(void)
 {
     memset(&data_rx, 0, MAX_TRANSMIT_SIZE);
@@ -67,29 +137,109 @@ static void send_tx_packets(void)
 
     struct radio_test_config test_config;
     memset(&test_config, 0, sizeof(test_config));
-    test_config.type = MODULATED_TX;
     test_config.mode = mode;
-    test_config.params.modulated_tx.txpower = tx_power;
-    test_config.params.modulated_tx.channel = channel;
-    test_config.params.modulated_tx.pattern = TRANSMIT_PATTERN_11110000;
-    test_config.params.modulated_tx.packets_num = 5000;
+    test_config.type = tx_test;
+    if (tx_test == TX_SWEEP)
+    {
+        test_config.params.tx_sweep.txpower = tx_power;
+        test_config.params.tx_sweep.channel_start = channel;
+        test_config.params.tx_sweep.channel_end = sweep_channel_end;
+        test_config.params.tx_sweep.delay_ms = sweep_delay_ms;
+    }
+    else if (tx_test == ACK_TX || tx_test == ACK_RX)
+    {
+        test_config.params.ack.txpower = tx_power;
+        test_config.params.ack.channel = channel;
+        test_config.params.ack.packets_num = packets_num;
+        test_config.params.ack.retries = retries;
+        test_config.params.ack.cb = tx_done;
+    }
+    else if (tx_test != MODULATED_TX)
+    {
+        // Back to back, ping-pong
+        test_config.params.modulated_tx.txpower = tx_power;
+        test_config.params.modulated_tx.channel = channel;
+        test_config.params.modulated_tx.pattern = pattern;
+        test_config.params.modulated_tx.packets_num = packets_num;
+        test_config.params.modulated_tx.cb = tx_done;
+    }
+    else if (duty_cycle < 100)
+    {
+        test_config.type = MODULATED_TX_DUTY_CYCLE;
+        test_config.params.modulated_tx_duty_cycle.txpower = tx_power;
+        test_config.params.modulated_tx_duty_cycle.channel = channel;
+        test_config.params.modulated_tx_duty_cycle.pattern = pattern;
+        test_config.params.modulated_tx_duty_cycle.duty_cycle = duty_cycle;
+    }
+    else
+    {
+        test_config.params.modulated_tx.txpower = tx_power;
+        test_config.params.modulated_tx.channel = channel;
+        test_config.params.modulated_tx.pattern = pattern;
+        test_config.params.modulated_tx.packets_num = packets_num;
+        test_config.params.modulated_tx.cb = tx_done;
+    }
 
     // Reset radio TX statistics
     radio_packets_sent = 0;
+    radio_tx_airtime_ns = 0;
+    radio_tx_duty_cycle_ppm = 0;
+    radio_tx_period_ns = 0;
+
+    // Sequence numbered payloads carry a timestamp
+    NRF_TIMER2->PRESCALER = 1;
+    NRF_TIMER2->BITMODE = TIMER_BITMODE_BITMODE_32Bit;
+    NRF_TIMER2->TASKS_CLEAR = TIMER_TASKS_CLEAR_TASKS_CLEAR_Trigger;
+    NRF_TIMER2->MODE = TIMER_MODE_MODE_Timer;
+
+    NRF_TIMER2->TASKS_START = TIMER_TASKS_START_TASKS_START_Trigger;
 
     bluetooth_disable();
     printk("Disabling MPSL\n");
     mpsl_lib_uninit();
 
     printk("Starting TX test\n");
+    k_sem_reset(&tx_done_sem);
     radio_test_init();
-    radio_test_start(&test_config);
 
-    k_msleep(30000);
+    if (radio_test_start(&test_config) != 0)
+    {
+        printk("Could not start TX test\n");
+    }
+    else if (test_config.type == MODULATED_TX && packets_num > 0)
+    {
+        int64_t start = k_uptime_get();
+        if (k_sem_take(&tx_done_sem, TX_COUNT_TIMEOUT) != 0)
+        {
+            printk("TX of %u packets timed out, %u sent\n", packets_num, radio_packets_sent);
+        }
+        printk("Sent %u packets in %lld ms\n", radio_packets_sent, k_uptime_get() - start);
+    }
+    else if (test_config.type == PING)
+    {
+        // Until the responder stops, if the pings aren't done by then
+        k_sem_take(&tx_done_sem, K_MSEC(TX_DURATION_MS));
+        printk("Sent %u pings\n", radio_packets_sent);
+    }
+    else if (test_config.type == ACK_TX)
+    {
+        k_sem_take(&tx_done_sem, K_MSEC(TX_DURATION_MS));
+        printk("Delivered %u frames in %u attempts\n", radio_frames_delivered, radio_packets_sent);
+    }
+    else if (test_config.type == PONG || test_config.type == ACK_RX)
+    {
+        k_msleep(PONG_DURATION_MS);
+    }
+    else
+    {
+        k_msleep(TX_DURATION_MS);
+    }
 
     printk("Cancelling test\n");
     radio_test_cancel();
 
+    NRF_TIMER2->TASKS_STOP = TIMER_TASKS_STOP_TASKS_STOP_Trigger;
+
     printk("Restarting MPSL and BT\n");
     mpsl_lib_init();
     bluetooth_enable();
@@ -102,25 +252,43 @@ static void receive_rx_packets(void)
 
     struct radio_test_config test_config;
     memset(&test_config, 0, sizeof(test_config));
-    test_config.type = RX;
     test_config.mode = mode;
-    test_config.params.rx.channel = channel;
-    test_config.params.rx.pattern = TRANSMIT_PATTERN_11110000;
+    test_config.type = rx_test;
+    if (rx_test == RX_SWEEP)
+    {
+        test_config.params.rx_sweep.channel_start = channel;
+        test_config.params.rx_sweep.channel_end = sweep_channel_end;
+        test_config.params.rx_sweep.delay_ms = sweep_delay_ms;
+    }
+    else
+    {
+        test_config.params.rx.channel = channel;
+        test_config.params.rx.pattern = pattern;
+    }
 
-    // Clear flash for logging
-    if (fs_erase(fs_flash_device, 20) != 0)
+    // Log into a new session, previous ones stay on flash until the log
+    // wraps around to them
+    fs_session_t session;
+    session.mode = mode;
+    session.channel = channel;
+    session.tx_power = tx_power;
+    session.packet_size = radio_packet_len_get(mode);
+
+    if (fs_session_start(fs_flash_device, &session) != 0)
     {
-        printk("receive_rx_packets: error! could not erase flash\n");
+        printk("receive_rx_packets: error! could not start log session\n");
         return;
     }
 
-    fs_reset();
-
     // Reset radio RX statistics
     radio_total_rssi = 0;
     radio_packets_received = 0;
     radio_total_crcok = 0;
     radio_has_received = false;
+    radio_rssi_stats_reset();
+    radio_seq_stats_reset();
+    radio_ber_stats_reset();
+    radio_channel_stats_reset();
 
     NRF_TIMER2->PRESCALER = 1;
     NRF_TIMER2->BITMODE = TIMER_BITMODE_BITMODE_32Bit;
@@ -135,17 +303,31 @@ static void receive_rx_packets(void)
 
     printk("receive_rx_packets: Starting RX test\n");
     radio_test_init();
-    radio_test_start(&test_config);
-    k_msleep(10);
-    radio_logging_active = true;
+    if (radio_test_start(&test_config) != 0)
+    {
+        printk("receive_rx_packets: Could not start RX test\n");
+    }
+    else
+    {
+        k_msleep(10);
+        radio_logging_start();
 
-    k_msleep(31000);
+        k_msleep(31000);
+
+        radio_logging_stop();
+    }
 
     printk("receive_rx_packets: Cancelling test\n");
-    radio_logging_active = false;
     radio_test_cancel();
     NRF_TIMER2->TASKS_STOP = TIMER_TASKS_STOP_TASKS_STOP_Trigger;
 
+    // Write out the last partially filled page of the log, and the record
+    // count of the session
+    if (fs_session_end(fs_flash_device) != 0)
+    {
+        printk("receive_rx_packets: error! could not end log session\n");
+    }
+
     printk("receive_rx_packets: Restarting MPSL and BT\n");
     mpsl_lib_init();
     bluetooth_enable();
@@ -155,6 +337,10 @@ static void receive_rx_packets(void)
     uint32_t ticks_taken = NRF_TIMER2->CC[1] - NRF_TIMER2->CC[0];
     printk("receive_rx_packets: Done with RX stats: total %u, crc %u, rssi %u, ticks %u, time_taken %u\n",
            radio_packets_received, radio_total_crcok, radio_total_rssi, ticks_taken, NRF_TIMER2->CC[2]);
+    printk("receive_rx_packets: logged %u snapshots, dropped %u\n",
+           radio_log_snapshots - radio_log_dropped, radio_log_dropped);
+    printk("receive_rx_packets: logged %u packet events, dropped %u\n",
+           radio_rx_events, radio_rx_events_dropped);
 }
 
 static ssize_t handle_host_command(
@@ -245,16 +431,141 @@ static ssize_t handle_host_command(
         packet_size = buffer[1];
         break;
 
+    case SET_SEQUENCE:
+        printk("SET_SEQUENCE %u\n", buffer[1]);
+        radio_sequence = buffer[1] != 0;
+        break;
+
+    case SET_BER:
+        printk("SET_BER %u\n", buffer[1]);
+        radio_ber = buffer[1] != 0;
+        break;
+
+    case SET_PATTERN:
+        printk("SET_PATTERN %u\n", buffer[1]);
+        if (buffer[1] > TRANSMIT_PATTERN_PRBS15)
+        {
+            printk("Invalid pattern %u\n", buffer[1]);
+            break;
+        }
+        pattern = buffer[1];
+        break;
+
+    case SET_DUTY_CYCLE:
+        printk("SET_DUTY_CYCLE %u\n", buffer[1]);
+        if (buffer[1] < 1 || buffer[1] > 100)
+        {
+            printk("Invalid duty cycle %u\n", buffer[1]);
+            break;
+        }
+        duty_cycle = buffer[1];
+        break;
+
+    case SET_PACKETS_NUM:
+        if (len < 5)
+        {
+            printk("Invalid packet count, length %u\n", len);
+            break;
+        }
+        packets_num = buffer[1] | buffer[2] << 8 | buffer[3] << 16 | (uint32_t)buffer[4] << 24;
+        printk("SET_PACKETS_NUM %u\n", packets_num);
+        break;
+
+    case SET_RETRIES:
+        printk("SET_RETRIES %u\n", buffer[1]);
+        if (buffer[1] >= RADIO_ACK_ATTEMPT_BINS)
+        {
+            printk("Invalid retries %u\n", buffer[1]);
+            break;
+        }
+        retries = buffer[1];
+        break;
+
     case START_TX:
         printk("START_TX\n");
+        tx_test = MODULATED_TX;
+        k_work_submit(&send_tx_packets_worker);
+        break;
+
+    case START_TX_THROUGHPUT:
+        printk("START_TX_THROUGHPUT\n");
+        tx_test = TX_THROUGHPUT;
+        k_work_submit(&send_tx_packets_worker);
+        break;
+
+    case START_PING:
+        printk("START_PING\n");
+        tx_test = PING;
+        k_work_submit(&send_tx_packets_worker);
+        break;
+
+    case START_PONG:
+        printk("START_PONG\n");
+        tx_test = PONG;
+        k_work_submit(&send_tx_packets_worker);
+        break;
+
+    case START_ACK_TX:
+        printk("START_ACK_TX\n");
+        tx_test = ACK_TX;
+        k_work_submit(&send_tx_packets_worker);
+        break;
+
+    case START_ACK_RX:
+        printk("START_ACK_RX\n");
+        tx_test = ACK_RX;
         k_work_submit(&send_tx_packets_worker);
         break;
 
     case START_RX:
         printk("SET_RX\n");
+        rx_test = RX;
         k_work_submit(&receive_rx_packets_worker);
         break;
 
+    case START_TX_SWEEP:
+    case START_RX_SWEEP:
+        if (len < 4 || buffer[1] < channel || buffer[1] > 100 ||
+            (buffer[2] | buffer[3] << 8) < SWEEP_DELAY_MIN_MS)
+        {
+            printk("Invalid sweep, length %u\n", len);
+            break;
+        }
+
+        sweep_channel_end = buffer[1];
+        sweep_delay_ms = buffer[2] | buffer[3] << 8;
+        printk("%s %u-%u every %u ms\n", buffer[0] == START_TX_SWEEP ? "START_TX_SWEEP" : "START_RX_SWEEP",
+               channel, sweep_channel_end, sweep_delay_ms);
+
+        if (buffer[0] == START_TX_SWEEP)
+        {
+            tx_test = TX_SWEEP;
+            k_work_submit(&send_tx_packets_worker);
+        }
+        else
+        {
+            rx_test = RX_SWEEP;
+            k_work_submit(&receive_rx_packets_worker);
+        }
+        break;
+
+    case SELECT_SESSION:
+        if (len < 5)
+        {
+            printk("Invalid SELECT_SESSION length %u\n", len);
+            break;
+        }
+
+        uint32_t session_id = buffer[1] | buffer[2] << 8 | buffer[3] << 16 | (uint32_t)buffer[4] << 24;
+        printk("SELECT_SESSION %u\n", session_id);
+        fs_session_select(fs_flash_device, session_id);
+        break;
+
+    case SELECT_CHANNELS:
+        printk("SELECT_CHANNELS %u\n", buffer[1]);
+        read_channel = MIN(buffer[1], RADIO_CHANNELS - 1);
+        break;
+
     default:
         break;
     }
@@ -274,7 +585,15 @@ static ssize_t read_tx_stats_handler(
     stats_read_buffer[2] = (radio_packets_sent >> 16) & 0xFF;
     stats_read_buffer[3] = (radio_packets_sent >> 24) & 0xFF;
 
-    return bt_gatt_attr_read(conn, attr, buf, len, offset, stats_read_buffer, 4);
+    uint16_t stats_len = 4 + radio_tx_stats_write(stats_read_buffer + 4);
+
+    // Acknowledged frames only carry their payload once
+    stats_len += radio_airtime_stats_write(stats_read_buffer + stats_len, radio_packets_sent,
+                                           tx_test == ACK_TX ? radio_frames_delivered : radio_packets_sent,
+                                           radio_tx_ticks());
+    stats_len += radio_ack_stats_write(stats_read_buffer + stats_len);
+
+    return bt_gatt_attr_read(conn, attr, buf, len, offset, stats_read_buffer, stats_len);
 }
 
 static ssize_t read_rx_stats_handler(
@@ -306,7 +625,87 @@ static ssize_t read_rx_stats_handler(
     stats_read_buffer[14] = (ticks_taken >> 16) & 0xFF;
     stats_read_buffer[15] = (ticks_taken >> 24) & 0xFF;
 
-    return bt_gatt_attr_read(conn, attr, buf, len, offset, stats_read_buffer, 16);
+    // Snapshots the flash log couldn't keep up with
+    stats_read_buffer[16] = radio_log_dropped & 0xFF;
+    stats_read_buffer[17] = (radio_log_dropped >> 8) & 0xFF;
+    stats_read_buffer[18] = (radio_log_dropped >> 16) & 0xFF;
+    stats_read_buffer[19] = (radio_log_dropped >> 24) & 0xFF;
+
+    // Per-packet events logged, and lost to a full event ring
+    stats_read_buffer[20] = radio_rx_events & 0xFF;
+    stats_read_buffer[21] = (radio_rx_events >> 8) & 0xFF;
+    stats_read_buffer[22] = (radio_rx_events >> 16) & 0xFF;
+    stats_read_buffer[23] = (radio_rx_events >> 24) & 0xFF;
+
+    stats_read_buffer[24] = radio_rx_events_dropped & 0xFF;
+    stats_read_buffer[25] = (radio_rx_events_dropped >> 8) & 0xFF;
+    stats_read_buffer[26] = (radio_rx_events_dropped >> 16) & 0xFF;
+    stats_read_buffer[27] = (radio_rx_events_dropped >> 24) & 0xFF;
+
+    uint16_t stats_len = 28;
+
+    stats_len += radio_rssi_stats_write(stats_read_buffer + stats_len);
+    stats_len += radio_seq_stats_write(stats_read_buffer + stats_len);
+    stats_len += radio_ber_stats_write(stats_read_buffer + stats_len);
+    stats_len += radio_airtime_stats_write(stats_read_buffer + stats_len,
+                                           radio_packets_received, radio_total_crcok, ticks_taken);
+
+    return bt_gatt_attr_read(conn, attr, buf, len, offset, stats_read_buffer, stats_len);
+}
+
+// RX counters of up to `MAX_READ_CHANNELS` channels from the one picked with
+// SELECT_CHANNELS on: first channel, number of channels, then
+// `RADIO_CHANNEL_STATS_LEN` bytes per channel
+static ssize_t read_channels_handler(
+    struct bt_conn *conn,
+    const struct bt_gatt_attr *attr,
+    void *buf,
+    uint16_t len,
+    uint16_t offset)
+{
+    uint16_t stats_len = radio_channel_stats_write(stats_read_buffer + 2, read_channel, MAX_READ_CHANNELS);
+
+    stats_read_buffer[0] = read_channel;
+    stats_read_buffer[1] = stats_len / RADIO_CHANNEL_STATS_LEN;
+
+    return bt_gatt_attr_read(conn, attr, buf, len, offset, stats_read_buffer, 2 + stats_len);
+}
+
+// Round trip times of the last PING test in the mode set with SET_TX_MODE
+static ssize_t read_latency_handler(
+    struct bt_conn *conn,
+    const struct bt_gatt_attr *attr,
+    void *buf,
+    uint16_t len,
+    uint16_t offset)
+{
+    uint16_t stats_len = radio_rtt_stats_write(stats_read_buffer, mode);
+
+    return bt_gatt_attr_read(conn, attr, buf, len, offset, stats_read_buffer, stats_len);
+}
+
+// Lists the sessions still on flash, newest first, `FS_SESSION_SIZE` bytes
+// each. Long reads come back here with an offset, so list them every time.
+static ssize_t read_sessions_handler(
+    struct bt_conn *conn,
+    const struct bt_gatt_attr *attr,
+    void *buf,
+    uint16_t len,
+    uint16_t offset)
+{
+    int n = fs_session_list(fs_flash_device, listed_sessions, MAX_LISTED_SESSIONS);
+    if (n < 0)
+    {
+        printk("read_sessions_handler: fs_session_list err %d\n", n);
+        return BT_GATT_ERR(BT_ATT_ERR_UNLIKELY);
+    }
+
+    for (int i = 0; i < n; i++)
+    {
+        fs_session_pack(&listed_sessions[i], stats_read_buffer + i * FS_SESSION_SIZE);
+    }
+
+    return bt_gatt_attr_read(conn, attr, buf, len, offset, stats_read_buffer, n * FS_SESSION_SIZE);
 }
 
 static void on_sent(struct bt_conn *conn, void *user_data)
@@ -369,7 +768,27 @@ BT_GATT_SERVICE_DEFINE(host_service,
                        BT_GATT_CHARACTERISTIC(RADIO_TX_STATS_CHARACTERISTIC_UUID,
                                               BT_GATT_CHRC_READ,
                                               BT_GATT_PERM_READ,
-                                              read_tx_stats_handler, NULL, NULL), );
+                                              read_tx_stats_handler, NULL, NULL),
+                       BT_GATT_CHARACTERISTIC(RADIO_SESSIONS_CHARACTERISTIC_UUID,
+                                              BT_GATT_CHRC_READ,
+                                              BT_GATT_PERM_READ,
+                                              read_sessions_handler, NULL, NULL),
+                       BT_GATT_CHARACTERISTIC(RADIO_CHANNELS_CHARACTERISTIC_UUID,
+                                              BT_GATT_CHRC_READ,
+                                              BT_GATT_PERM_READ,
+                                              read_channels_handler, NULL, NULL),
+                       BT_GATT_CHARACTERISTIC(RADIO_LATENCY_CHARACTERISTIC_UUID,
+                                              BT_GATT_CHRC_READ,
+                                              BT_GATT_PERM_READ,
+                                              read_latency_handler, NULL, NULL), );
+
+// Smallest MTU of the connections a notification goes to
+static void log_chunk_mtu(struct bt_conn *conn, void *data)
+{
+    uint16_t *mtu = data;
+
+    *mtu = MIN(*mtu, bt_gatt_get_mtu(conn));
+}
 
 int send_all_logs(void)
 {
@@ -377,46 +796,45 @@ int send_all_logs(void)
 
     const struct bt_gatt_attr *attr = &host_service.attrs[3];
 
-    uint8_t part = 1;
+    uint16_t mtu = UINT16_MAX;
+    bt_conn_foreach(BT_CONN_TYPE_LE, log_chunk_mtu, &mtu);
+    if (mtu == UINT16_MAX)
+    {
+        mtu = BT_ATT_DEFAULT_LE_MTU;
+    }
 
-    flash_read_t result;
+    // Log bytes per notification, a whole MTU's worth. Cursors need room
+    // for a record header.
+    uint16_t chunk_size = MAX(MIN(mtu - ATT_NOTIFY_HEADER_SIZE, sizeof(stats_read_buffer)), FS_HEADER_SIZE);
 
-    while (true)
+    fs_cursor_t cursor;
+    int err = fs_cursor_open(fs_flash_device, &cursor);
+    if (err != 0)
     {
-        result = fs_read(fs_flash_device, stats_read_buffer, part);
-
-        if (result.res != FS_SUCCESS)
-        {
-            printk("send_all_logs: read result %d\n", result.res);
-            break;
-        }
+        printk("send_all_logs: fs_cursor_open err %d\n", err);
+        return err;
+    }
 
-        if (!indicate_active)
+    // Stream the selected session straight from flash, one notification per
+    // chunk
+    while (indicate_active)
+    {
+        int n = fs_cursor_next_chunk(fs_flash_device, &cursor, stats_read_buffer, chunk_size);
+        if (n <= 0)
         {
+            printk("send_all_logs: read result %d\n", n);
             break;
         }
 
-        // Buffer tends to be big, send as max mtu
-        // uint16_t mtu = bt_gatt_get_mtu(bt_current_conn);
-        uint16_t mtu = 20;
-        for (size_t byte_index = 0; byte_index < result.bytes_read; byte_index += mtu)
+        err = bt_gatt_notify(NULL, attr, stats_read_buffer, n);
+        if (err != 0)
         {
-            size_t remaining_bytes = mtu;
-            if (byte_index + mtu > result.bytes_read)
-            {
-                remaining_bytes = result.bytes_read - byte_index;
-            }
-
-            int err = bt_gatt_notify(NULL, attr, stats_read_buffer + byte_index, remaining_bytes);
-            if (err != 0)
-            {
-                printk("send_all_logs: bt_gatt_indicate err %d\n", err);
-            }
+            printk("send_all_logs: bt_gatt_notify err %d\n", err);
         }
-
-        part++;
     }
 
+    fs_cursor_close(&cursor);
+
     printk("send_all_logs: end\n");
     return 0;
 }
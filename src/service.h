@@ -14,9 +14,44 @@ typedef enum
     SET_TX_POWER = 0x01,
     SET_TX_CHANNEL = 0x02,
     SET_PACKET_SIZE = 0x03,
+    // Followed by 1 to stamp TX payloads with a sequence number and check
+    // them on RX, 0 to stop
+    SET_SEQUENCE = 0x04,
+    // Followed by 1 to count bit errors in every received payload, 0 to stop
+    SET_BER = 0x05,
+    // Followed by an `enum transmit_pattern`, RANDOM is PRBS9
+    SET_PATTERN = 0x06,
+    // Followed by the percent of the time TX is on air, 1 to 100
+    SET_DUTY_CYCLE = 0x07,
+    // Followed by the number of packets START_TX sends, 4 bytes little
+    // endian, 0 to send for 30 s
+    SET_PACKETS_NUM = 0x08,
+    // Followed by the times START_ACK_TX sends a frame again without an
+    // ACK, 0 to 15
+    SET_RETRIES = 0x09,
 
     START_TX = 0x10,
     START_RX = 0x11,
+    // Hop from the channel set with SET_TX_CHANNEL up to the one that
+    // follows, 1 byte, every so many ms, 2 bytes little endian
+    START_TX_SWEEP = 0x12,
+    START_RX_SWEEP = 0x13,
+    // Back to back TX at the highest rate the radio allows
+    START_TX_THROUGHPUT = 0x14,
+    // Round trips to a responder started with START_PONG, packets_num
+    // pings or until the test duration ends
+    START_PING = 0x15,
+    START_PONG = 0x16,
+    // Acknowledged frames to a receiver started with START_ACK_RX,
+    // packets_num frames or until the test duration ends
+    START_ACK_TX = 0x17,
+    START_ACK_RX = 0x18,
+
+    // Followed by a session id, 4 bytes little endian, 0 for the latest
+    SELECT_SESSION = 0x20,
+
+    // Followed by the first channel the channels characteristic returns
+    SELECT_CHANNELS = 0x21,
 } command_t;
 
 extern bool indicate_active;